@@ -0,0 +1,301 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Throughput and latency benchmark of the default log callback.
+ *
+ * usage: bench [options]
+ *   -t threads   number of logging threads (1)
+ *   -n count     messages per thread (100000)
+ *   -s size      message size in bytes, 0 for a short message (0)
+ *   -o output    stderr, null or a file name (null)
+ *   -d           log at a disabled level
+ *   -r           set LOG_SKIP_REPEATED, all messages are then identical
+ *   -a capacity  use log_set_async() with this queue capacity
+ *   -b bytes     buffer the output up to this many bytes or 100 ms
+ *
+ * Without options a fixed set of scenarios is run, each in its own process
+ * so that they do not share any logging state. Results go to stdout, one
+ * line per scenario, with the latency percentiles of single log() calls
+ * in ns.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define FFMAX(a,b) ((a) > (b) ? (a) : (b))
+#define FFMIN(a,b) ((a) > (b) ? (b) : (a))
+
+typedef struct Scenario {
+    int threads;
+    int count;
+    int size;
+    const char *output;
+    int disabled;
+    int skip_repeated;
+    unsigned async;
+    int buffer;
+} Scenario;
+
+typedef struct Worker {
+    pthread_t thread;
+    const Scenario *sc;
+    int index;
+    char *msg;
+    uint32_t *lat;          ///< per call latency in ns
+} Worker;
+
+static pthread_barrier_t start_barrier;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void *worker_thread(void *arg)
+{
+    Worker *w = arg;
+    const Scenario *sc = w->sc;
+    int level = sc->disabled ? LOG_TRACE : LOG_INFO;
+    int i;
+
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < sc->count; i++) {
+        int64_t t = now_ns();
+        if (sc->skip_repeated)
+            log("bench", level, "%s\n", w->msg);
+        else
+            log("bench", level, "thread %d message %d %s\n", w->index, i, w->msg);
+        w->lat[i] = (uint32_t)FFMIN(now_ns() - t, (int64_t)UINT32_MAX);
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *lat, size_t n, double p)
+{
+    size_t i = (size_t)(p * (n - 1) + 0.5);
+    return lat[FFMIN(i, n - 1)];
+}
+
+/**
+ * Point fd 2, where the default callback writes, to the scenario output.
+ * @return a descriptor of the original fd 2, to restore it afterwards
+ */
+static int redirect_output(const char *output)
+{
+    int saved = dup(2), fd;
+
+    if (!strcmp(output, "stderr"))
+        return saved;
+    if (!strcmp(output, "null"))
+        fd = open("/dev/null", O_WRONLY);
+    else
+        fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", output, strerror(errno));
+        exit(1);
+    }
+    dup2(fd, 2);
+    close(fd);
+    return saved;
+}
+
+static int run(const Scenario *sc)
+{
+    Worker *w = calloc(sc->threads, sizeof(*w));
+    uint32_t *all = malloc((size_t)sc->threads * sc->count * sizeof(*all));
+    int64_t start, elapsed;
+    size_t total = (size_t)sc->threads * sc->count;
+    int i, saved;
+
+    if (!w || !all) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    for (i = 0; i < sc->threads; i++) {
+        w[i].sc    = sc;
+        w[i].index = i;
+        w[i].lat   = all + (size_t)i * sc->count;
+        w[i].msg   = malloc(sc->size + 1);
+        if (!w[i].msg) {
+            fprintf(stderr, "out of memory\n");
+            return -1;
+        }
+        memset(w[i].msg, 'a' + i % 26, sc->size);
+        w[i].msg[sc->size] = 0;
+    }
+
+    fflush(stderr);
+    saved = redirect_output(sc->output);
+    log_set_flags(sc->skip_repeated ? LOG_SKIP_REPEATED : 0);
+    log_set_level(LOG_INFO);
+    if (sc->async)
+        log_set_async(sc->async);
+    if (sc->buffer) {
+        LogFlushPolicy policy = { sc->buffer, 100, LOG_ERROR, 0 };
+        log_sink_set_flush_policy(NULL, &policy);
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, sc->threads + 1);
+    for (i = 0; i < sc->threads; i++)
+        pthread_create(&w[i].thread, NULL, worker_thread, &w[i]);
+    pthread_barrier_wait(&start_barrier);
+    start = now_ns();
+    for (i = 0; i < sc->threads; i++)
+        pthread_join(w[i].thread, NULL);
+    /* queued messages are part of the cost */
+    if (sc->skip_repeated)
+        log(NULL, LOG_QUIET, "%s", "");
+    log_flush();
+    elapsed = now_ns() - start;
+    pthread_barrier_destroy(&start_barrier);
+
+    if (sc->async)
+        log_set_async(0);
+    dup2(saved, 2);
+    close(saved);
+
+    qsort(all, total, sizeof(*all), cmp_u32);
+    printf("threads %2d  size %4d  %-8s %-8s %-6s %-6s %-8s  %10.0f msg/s  "
+           "p50 %6"PRIu32"  p99 %7"PRIu32"  p99.9 %8"PRIu32" ns\n",
+           sc->threads, sc->size, sc->output,
+           sc->disabled ? "disabled" : "enabled",
+           sc->skip_repeated ? "skip" : "noskip",
+           sc->async ? "async" : "sync",
+           sc->buffer ? "buffered" : "direct",
+           total * 1e9 / FFMAX(elapsed, 1),
+           percentile(all, total, 0.50),
+           percentile(all, total, 0.99),
+           percentile(all, total, 0.999));
+    fflush(stdout);
+
+    for (i = 0; i < sc->threads; i++)
+        free(w[i].msg);
+    free(w);
+    free(all);
+    return 0;
+}
+
+static void run_process(const Scenario *sc)
+{
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (!pid)
+        _exit(run(sc) < 0);
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status))
+        printf("threads %2d  size %4d  %-8s crashed with signal %d\n",
+               sc->threads, sc->size, sc->output, WTERMSIG(status));
+}
+
+int main(int argc, char **argv)
+{
+    Scenario sc = { 1, 100000, 0, "null", 0, 0, 0, 0 };
+    int opt, i;
+
+    if (argc == 1) {
+        static const int threads[] = { 1, 4 };
+        static const int sizes[]   = { 0, 4096 };
+        static const char *outputs[] = { "stderr", "null", "bench.log" };
+
+        for (i = 0; i < 2; i++) {
+            Scenario s = sc;
+            s.threads  = threads[i];
+            s.disabled = 1;
+            run_process(&s);
+        }
+        for (i = 0; i < 2 * 2 * 3; i++) {
+            Scenario s = sc;
+            s.threads = threads[i % 2];
+            s.size    = sizes[i / 2 % 2];
+            s.output  = outputs[i / 4];
+            s.count   = s.output == outputs[0] ? 10000 : sc.count;
+            run_process(&s);
+        }
+        for (i = 0; i < 2; i++) {
+            Scenario s = sc;
+            s.threads       = threads[i];
+            s.skip_repeated = 1;
+            run_process(&s);
+        }
+        for (i = 0; i < 2; i++) {
+            Scenario s = sc;
+            s.threads = threads[i];
+            s.async   = 65536;
+            run_process(&s);
+        }
+        for (i = 0; i < 2; i++) {
+            Scenario s = sc;
+            s.threads = threads[i];
+            s.output  = outputs[2];
+            s.buffer  = 65536;
+            run_process(&s);
+        }
+        unlink("bench.log");
+        return 0;
+    }
+
+    while ((opt = getopt(argc, argv, "t:n:s:o:dra:b:")) != -1) {
+        switch (opt) {
+        case 't': sc.threads       = atoi(optarg); break;
+        case 'n': sc.count         = atoi(optarg); break;
+        case 's': sc.size          = atoi(optarg); break;
+        case 'o': sc.output        = optarg;       break;
+        case 'd': sc.disabled      = 1;            break;
+        case 'r': sc.skip_repeated = 1;            break;
+        case 'a': sc.async         = atoi(optarg); break;
+        case 'b': sc.buffer        = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-n count] [-s size] "
+                    "[-o stderr|null|file] [-d] [-r] [-a capacity] [-b bytes]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (sc.threads < 1 || sc.count < 1 || sc.size < 0 || sc.buffer < 0) {
+        fprintf(stderr, "invalid parameters\n");
+        return 1;
+    }
+    return run(&sc) < 0;
+}
@@ -30,20 +30,39 @@
 #if HAVE_IO_H
 #include <io.h>
 #endif
+#include <sys/uio.h>
+#include <unistd.h>
 #include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <limits.h>
 #include <errno.h>
+#include <sched.h>
+#include <signal.h>
 #include <time.h>
+#include <fcntl.h>
 #include "error.h"
 
+#ifndef HAVE_X86_SIMD
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#else
+#define HAVE_X86_SIMD 0
+#endif
+#endif
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #include "log.h"
+#include "logbin.h"
+#include "logsink.h"
 
 typedef enum {
     CLASS_CATEGORY_NA = 0,
@@ -76,8 +95,13 @@ typedef enum {
      ((category) == CLASS_CATEGORY_DEVICE_AUDIO_OUTPUT) || \
      ((category) == CLASS_CATEGORY_DEVICE_OUTPUT))
 
-#define isatty(fd) 1
-
+#ifndef HAVE_ISATTY
+#ifdef _WIN32
+#define HAVE_ISATTY 0
+#else
+#define HAVE_ISATTY 1
+#endif
+#endif
 
 /** 
  * Comparator.
@@ -91,6 +115,8 @@ typedef enum {
 
 #define FFMAX(a,b) ((a) > (b) ? (a) : (b))
 #define FFMIN(a,b) ((a) > (b) ? (b) : (a))
+#define FFSWAP(type,a,b) do{type SWAP_tmp= b; b= a; a= SWAP_tmp;}while(0)
+#define FF_ARRAY_ELEMS(a) (sizeof(a) / sizeof((a)[0]))
    
 /* error handling */
 #if 1
@@ -116,57 +142,164 @@ typedef enum {
 
 
 
-void *realloc(void *ptr, size_t size)
+/**
+ * Memory allocation.
+ *
+ * All memory of this file and of the sinks goes through the functions set
+ * with log_set_allocator(), libc by default.
+ */
+
+static void *(*realloc_fn)(void *ptr, size_t size) = realloc;
+static void  (*free_fn)(void *ptr)                 = free;
+
+static void *mem_realloc(void *ptr, size_t size)
 {
-	void *ret;
+    static atomic_intptr_t max_alloc_size = ATOMIC_VAR_INIT(2147483647);
+
+    if (size > atomic_load_explicit(&max_alloc_size, memory_order_relaxed))
+        return NULL;
 
-#define ATOMIC_VAR_INIT(value) (value)
-	/* NOTE: if you want to override these functions with your own
-	 * implementations (not recommended) you have to link libav* as
-	 * dynamic libraries and remove -Wl,-Bsymbolic from the linker flags.
-	 * Note that this will cost performance. */
+    return realloc_fn(ptr, size + !size);
+}
 
-	static intptr_t max_alloc_size = ATOMIC_VAR_INIT(2147483647);
+static void *mem_malloc(size_t size)
+{
+    return mem_realloc(NULL, size);
+}
 
-#define atomic_load(object) \
-	(*(object))
-#define atomic_load_explicit(object, order) \
-	atomic_load(object)
+static void *mem_mallocz(size_t size)
+{
+    void *ptr = mem_malloc(size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
 
+static void mem_free(void *ptr)
+{
+    free_fn(ptr);
+}
 
-	if (size > atomic_load_explicit(&max_alloc_size, memory_order_relaxed))
-		return NULL;
+void log_set_allocator(void *(*realloc_cb)(void *ptr, size_t size),
+                       void (*free_cb)(void *ptr))
+{
+    realloc_fn = realloc_cb ? realloc_cb : realloc;
+    free_fn    = free_cb    ? free_cb    : free;
+}
 
-#if HAVE_ALIGNED_MALLOC
-    ret = _aligned_realloc(ptr, size + !size, ALIGN);
-#else
-    ret = realloc(ptr, size + !size);
-#endif
-#if CONFIG_MEMORY_POISONING
-    if (ret && !ptr)
-        memset(ret, FF_MEMORY_POISON, size);
-#endif
-    return ret;
+void *log_mem_realloc(void *ptr, size_t size)
+{
+    return mem_realloc(ptr, size);
+}
+
+void *log_mem_mallocz(size_t size)
+{
+    return mem_mallocz(size);
+}
+
+void log_mem_free(void *ptr)
+{
+    mem_free(ptr);
 }
 
 static void *memdup(const void *p, size_t size)
 {
     void *ptr = NULL;
     if (p) {
-        ptr = malloc(size);
+        ptr = mem_malloc(size);
         if (ptr)
             memcpy(ptr, p, size);
     }
     return ptr;
 }
 
-static void freep(void *arg)
+/**
+ * Per thread pool of print buffers.
+ *
+ * Messages longer than the internal buffer of an AVBPrint would otherwise
+ * cost a malloc() and a free() each; instead, buffers released by
+ * bprint_finalize() are kept and handed out again by bprint_alloc().
+ */
+
+#define POOL_SLOTS    4
+#define POOL_MAX_SIZE (256 * 1024)
+
+typedef struct BufPool {
+    int nb;
+    char *buf[POOL_SLOTS];
+    unsigned size[POOL_SLOTS];
+} BufPool;
+
+static __thread BufPool buf_pool;
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void pool_release(void *arg)
+{
+    BufPool *pool = arg;
+
+    while (pool->nb > 0)
+        mem_free(pool->buf[--pool->nb]);
+}
+
+static void pool_init(void)
 {
-    void *val;
+    pthread_key_create(&pool_key, pool_release);
+}
+
+/**
+ * Take a buffer of at least min_size and at most max_size bytes from the
+ * pool of the thread.
+ * @return the buffer, NULL if there is none
+ */
+static char *pool_get(unsigned min_size, unsigned max_size, unsigned *size)
+{
+    BufPool *pool = &buf_pool;
+    char *buf;
+    int i;
+
+    for (i = 0; i < pool->nb; i++) {
+        if (pool->size[i] >= min_size && pool->size[i] <= max_size) {
+            buf   = pool->buf[i];
+            *size = pool->size[i];
+            pool->nb--;
+            pool->buf[i]  = pool->buf[pool->nb];
+            pool->size[i] = pool->size[pool->nb];
+            return buf;
+        }
+    }
+    return NULL;
+}
 
-    memcpy(&val, arg, sizeof(val));
-    memcpy(arg, &(void *){ NULL }, sizeof(val));
-    free(val);
+static void pool_put(char *buf, unsigned size)
+{
+    BufPool *pool = &buf_pool;
+    int i, smallest = 0;
+
+    if (size > POOL_MAX_SIZE) {
+        mem_free(buf);
+        return;
+    }
+    if (pool->nb < POOL_SLOTS) {
+        /* the key frees the pool when the thread exits */
+        if (!pool->nb) {
+            pthread_once(&pool_once, pool_init);
+            pthread_setspecific(pool_key, pool);
+        }
+        pool->buf[pool->nb]  = buf;
+        pool->size[pool->nb] = size;
+        pool->nb++;
+        return;
+    }
+    /* keep the largest buffers */
+    for (i = 1; i < POOL_SLOTS; i++)
+        if (pool->size[i] < pool->size[smallest])
+            smallest = i;
+    if (pool->size[smallest] < size) {
+        FFSWAP(char *,   buf,  pool->buf[smallest]);
+        FFSWAP(unsigned, size, pool->size[smallest]);
+    }
+    mem_free(buf);
 }
 
 /**
@@ -389,8 +522,8 @@ static int bprint_alloc(AVBPrint *buf, unsigned room)
     if (new_size < min_size)
         new_size = FFMIN(buf->size_max, min_size);
     old_str = bprint_is_allocated(buf) ? buf->str : NULL;
-    new_str = realloc(old_str, new_size);
-    if (!new_str)
+    new_str = old_str ? NULL : pool_get(min_size, buf->size_max, &new_size);
+    if (!new_str && !(new_str = mem_realloc(old_str, new_size)))
         return AVERROR(ENOMEM);
     if (!old_str)
         memcpy(new_str, buf->str, buf->len + 1);
@@ -435,25 +568,162 @@ void bprint_init_for_buffer(AVBPrint *buf, char *buffer, unsigned size)
 
 void bprintf(AVBPrint *buf, const char *fmt, ...)
 {
-    unsigned room;
-    char *dst;
     va_list vl;
-    int extra_len;
 
-    while (1) {
-        room = bprint_room(buf);
-        dst = room ? buf->str + buf->len : NULL;
-        va_start(vl, fmt);
-        extra_len = vsnprintf(dst, room, fmt, vl);
-        va_end(vl);
-        if (extra_len <= 0)
-            return;
-        if (extra_len < room)
+    va_start(vl, fmt);
+    vbprintf(buf, fmt, vl);
+    va_end(vl);
+}
+
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/**
+ * Write v in decimal, ending at end.
+ * @return the number of characters written
+ */
+static unsigned format_dec(char *end, uint64_t v)
+{
+    char *p = end;
+
+    while (v >= 100) {
+        unsigned i = v % 100 * 2;
+        v /= 100;
+        p -= 2;
+        memcpy(p, digit_pairs + i, 2);
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + v * 2, 2);
+    } else {
+        *--p = '0' + v;
+    }
+    return end - p;
+}
+
+static unsigned format_hex(char *end, uint64_t v, const char *digits)
+{
+    char *p = end;
+
+    do {
+        *--p = digits[v & 15];
+        v >>= 4;
+    } while (v);
+    return end - p;
+}
+
+/**
+ * Fast path of vbprintf() for the conversions most log messages are made
+ * of: %d %i %u %x %X with the l, ll and z modifiers, %c, %s with an
+ * optional precision (also as .*), %p and %%, without flags or width.
+ * Everything is written straight into buf.
+ *
+ * @return 0 on success, AVERROR(ENOSYS) if fmt contains any other
+ *         conversion; buf is then left as it was
+ */
+static int fast_vbprintf(AVBPrint *buf, const char *fmt, va_list vl)
+{
+    unsigned len0 = buf->len;
+    const char *p;
+
+    while ((p = strchr(fmt, '%'))) {
+        char num[24], *end = num + sizeof(num);
+        const char *str;
+        int size = 0, prec = -1;
+        unsigned n;
+        uint64_t u;
+        int64_t i;
+        void *ptr;
+
+        if (p > fmt)
+            bprint_append_data(buf, fmt, p - fmt);
+        p++;
+
+        if (p[0] == '.' && p[1] == '*') {
+            prec = va_arg(vl, int);
+            p += 2;
+        } else if (p[0] == '.') {
+            for (prec = 0, p++; *p >= '0' && *p <= '9'; p++)
+                prec = prec * 10 + *p - '0';
+        }
+        if (*p == 'l') {
+            size = *++p == 'l' ? p++, 2 : 1;
+        } else if (*p == 'z') {
+            size = 3;
+            p++;
+        }
+        if (prec >= 0 && *p != 's')
+            goto unsupported;
+
+        switch (*p) {
+        case 'd':
+        case 'i':
+            i = size == 0 ? va_arg(vl, int)  :
+                size == 1 ? va_arg(vl, long) :
+                size == 2 ? va_arg(vl, long long) : va_arg(vl, ptrdiff_t);
+            n = format_dec(end, i < 0 ? -(uint64_t)i : i);
+            if (i < 0)
+                end[-(int)++n] = '-';
+            bprint_append_data(buf, end - n, n);
             break;
-        if (bprint_alloc(buf, extra_len))
+        case 'u':
+        case 'x':
+        case 'X':
+            u = size == 0 ? va_arg(vl, unsigned)      :
+                size == 1 ? va_arg(vl, unsigned long) :
+                size == 2 ? va_arg(vl, unsigned long long) : va_arg(vl, size_t);
+            n = *p == 'u' ? format_dec(end, u) :
+                format_hex(end, u, *p == 'x' ? "0123456789abcdef" : "0123456789ABCDEF");
+            bprint_append_data(buf, end - n, n);
+            break;
+        case 'p':
+            if (size)
+                goto unsupported;
+            /* same output as glibc */
+            if (!(ptr = va_arg(vl, void *))) {
+                bprint_append_data(buf, "(nil)", 5);
+                break;
+            }
+            n = format_hex(end, (uintptr_t)ptr, "0123456789abcdef");
+            end[-(int)++n] = 'x';
+            end[-(int)++n] = '0';
+            bprint_append_data(buf, end - n, n);
+            break;
+        case 'c':
+            if (size)
+                goto unsupported;
+            num[0] = va_arg(vl, int);
+            bprint_append_data(buf, num, 1);
+            break;
+        case 's':
+            if (size)
+                goto unsupported;
+            if (!(str = va_arg(vl, const char *)))
+                str = prec < 0 || prec >= 6 ? "(null)" : "";
+            n = prec < 0 ? strlen(str) : strnlen(str, prec);
+            bprint_append_data(buf, str, n);
             break;
+        case '%':
+            if (size)
+                goto unsupported;
+            bprint_append_data(buf, "%", 1);
+            break;
+        default:
+            goto unsupported;
+        }
+        fmt = p + 1;
     }
-    bprint_grow(buf, extra_len);
+    if (*fmt)
+        bprint_append_data(buf, fmt, strlen(fmt));
+    return 0;
+
+unsupported:
+    buf->len = len0;
+    if (buf->size)
+        buf->str[FFMIN(len0, buf->size - 1)] = 0;
+    return AVERROR(ENOSYS);
 }
 
 void vbprintf(AVBPrint *buf, const char *fmt, va_list vl_arg)
@@ -463,6 +733,13 @@ void vbprintf(AVBPrint *buf, const char *fmt, va_list vl_arg)
     int extra_len;
     va_list vl;
 
+    va_copy(vl, vl_arg);
+    extra_len = fast_vbprintf(buf, fmt, vl);
+    va_end(vl);
+    if (!extra_len)
+        return;
+
+    /* floating point, flags, width... */
     while (1) {
         room = bprint_room(buf);
         dst = room ? buf->str + buf->len : NULL;
@@ -582,7 +859,7 @@ int bprint_finalize(AVBPrint *buf, char **ret_str)
 
     if (ret_str) {
         if (bprint_is_allocated(buf)) {
-            str = realloc(buf->str, real_size);
+            str = mem_realloc(buf->str, real_size);
             if (!str)
                 str = buf->str;
             buf->str = NULL;
@@ -593,8 +870,10 @@ int bprint_finalize(AVBPrint *buf, char **ret_str)
         }
         *ret_str = str;
     } else {
-        if (bprint_is_allocated(buf))
-            freep(&buf->str);
+        if (bprint_is_allocated(buf)) {
+            pool_put(buf->str, buf->size);
+            buf->str = NULL;
+        }
     }
     buf->size = real_size;
     return ret;
@@ -606,6 +885,7 @@ int bprint_finalize(AVBPrint *buf, char **ret_str)
 
 /******************************************************************************************************/
 
+/* serializes writes to stderr, every sink has a lock of its own */
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #define LINE_SZ 1024
@@ -616,7 +896,10 @@ static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 #define BACKTRACE_LOGLEVEL LOG_ERROR
 #endif
 
-static int log_level = LOG_INFO;
+static atomic_int log_level = LOG_INFO;
+int log_threshold = LOG_INFO;
+static int output_threshold = LOG_INFO;  ///< log_threshold without the recorder
+int log_recorder_level = INT_MIN;
 static int flags;
 
 #define NB_LEVELS 8
@@ -683,7 +966,8 @@ static const uint32_t color[16 + CLASS_CATEGORY_NB] = {
 };
 
 #endif
-static int use_color = -1;
+static int use_color;
+static pthread_once_t color_once = PTHREAD_ONCE_INIT;
 
 #if defined(_WIN32) && HAVE_SETCONSOLETEXTATTRIBUTE && HAVE_GETSTDHANDLE
 /**
@@ -790,7 +1074,7 @@ static void check_color_terminal(void)
     }
 #endif
 
-    if (getenv("LOG_FORCE_NOCOLOR")) {
+    if (getenv("LOG_FORCE_NOCOLOR") || getenv("NO_COLOR")) {
         use_color = 0;
     } else if (getenv("LOG_FORCE_COLOR")) {
         use_color = 1;
@@ -808,6 +1092,7 @@ static void check_color_terminal(void)
         use_color *= 256;
 }
 
+#if defined(_WIN32) && HAVE_SETCONSOLETEXTATTRIBUTE && HAVE_GETSTDHANDLE
 static void ansi_fputs(int level, int tint, const char *str, int local_use_color)
 {
 	if (local_use_color == 1) {
@@ -838,19 +1123,11 @@ static void colored_fputs(int level, int tint, const char *str)
     if (!*str)
         return;
 
-    if (use_color < 0)
-        check_color_terminal();
+    pthread_once(&color_once, check_color_terminal);
 
     if (level == LOG_INFO/8) local_use_color = 0;
     else                        local_use_color = use_color;
 
-#if 1
-	//test
-	use_color = 256;
-	local_use_color = 1;
-#endif
-
-#if defined(_WIN32) && HAVE_SETCONSOLETEXTATTRIBUTE && HAVE_GETSTDHANDLE
     if (con != INVALID_HANDLE_VALUE) {
         if (local_use_color)
             SetConsoleTextAttribute(con, background | color[level]);
@@ -860,184 +1137,2888 @@ static void colored_fputs(int level, int tint, const char *str)
     } else {
         ansi_fputs(level, tint, str, local_use_color);
     }
-#else
-    ansi_fputs(level, tint, str, local_use_color);
-#endif
 
 }
+#else
 
-static void sanitize(uint8_t *line){
-    while(*line){
-        if(*line < 0x08 || (*line > 0x0D && *line < 0x20))
-            *line='?';
-        line++;
-    }
+#define ESC_SZ 32
+
+typedef struct Escape {
+    uint8_t len;
+    char str[ESC_SZ - 1];
+} Escape;
+
+/* escape sequences, built once by init_color(): one per entry of color[]
+   for 16 and 256 color terminals, and for tints the background of the
+   256 color one followed by one of 256 foregrounds */
+static Escape esc_16 [16 + CLASS_CATEGORY_NB];
+static Escape esc_256[16 + CLASS_CATEGORY_NB];
+static Escape esc_bg [16 + CLASS_CATEGORY_NB];
+static Escape esc_fg [256];
+static const char esc_reset[] = "\033[0m";
+
+static void set_escape(Escape *e, const char *fmt, ...)
+{
+    va_list vl;
+
+    va_start(vl, fmt);
+    e->len = vsnprintf(e->str, sizeof(e->str), fmt, vl);
+    va_end(vl);
 }
 
-static const char *get_level_str(int level)
+/**
+ * Detect the terminal and build the escape sequences, once.
+ * Without colors, for instance when stderr is not a terminal, nothing is
+ * built as no escape sequence is ever written.
+ */
+static void init_color(void)
 {
-    switch (level) {
-    case LOG_QUIET:
-        return "quiet";
-    case LOG_DEBUG:
-        return "debug";
-    case LOG_TRACE:
-        return "trace";
-    case LOG_VERBOSE:
-        return "verbose";
-    case LOG_INFO:
-        return "info";
-    case LOG_WARNING:
-        return "warning";
-    case LOG_ERROR:
-        return "error";
-    case LOG_FATAL:
-        return "fatal";
-    case LOG_PANIC:
-        return "panic";
-    default:
-        return "";
+    int i;
+
+    check_color_terminal();
+    if (!use_color)
+        return;
+
+    for (i = 0; i < 16 + CLASS_CATEGORY_NB; i++) {
+        set_escape(&esc_16[i], "\033[%u;3%um", (color[i] >> 4) & 15, color[i] & 15);
+        set_escape(&esc_256[i], "\033[48;5;%um\033[38;5;%um",
+                   (color[i] >> 16) & 0xff, (color[i] >> 8) & 0xff);
+        set_escape(&esc_bg[i], "\033[48;5;%um", (color[i] >> 16) & 0xff);
     }
+    for (i = 0; i < 256; i++)
+        set_escape(&esc_fg[i], "\033[38;5;%um", i);
 }
 
-static void format_line(void *name, int level, const char *fmt, va_list vl,
-                        AVBPrint part[4], int *print_prefix, int type[2])
+/**
+ * Describe str, colored for level, with iovecs.
+ *
+ * @param iov  receives up to 4 entries
+ * @param tint 256 color foreground replacing the one of level, 0 for none
+ * @return number of entries written to iov
+ */
+static int colored_iov(struct iovec *iov, int level, int tint, char *str, size_t len)
 {
-    bprint_init(part+0, 0, BPRINT_SIZE_AUTOMATIC);
-    bprint_init(part+1, 0, BPRINT_SIZE_AUTOMATIC);
-    bprint_init(part+2, 0, BPRINT_SIZE_AUTOMATIC);
-    bprint_init(part+3, 0, 65536);
+    const Escape *esc, *fg = NULL;
+    int local_use_color, n = 0;
 
-    if(type) type[0] = type[1] = CLASS_CATEGORY_NA + 16;
+    if (!len)
+        return 0;
 
-	if (*print_prefix && name) {
-		bprintf(part+1, "[%s @ %s] ", (char *)name, "reserve");
-	}
-    if (*print_prefix && (level > LOG_QUIET) && (flags & LOG_PRINT_LEVEL))
-        bprintf(part+2, "[%s] ", get_level_str(level));
+    pthread_once(&color_once, init_color);
 
-    vbprintf(part+3, fmt, vl);
+    if (level == LOG_INFO/8) local_use_color = 0;
+    else                        local_use_color = use_color;
 
-    if(*part[0].str || *part[1].str || *part[2].str || *part[3].str) {
-        char lastc = part[3].len && part[3].len <= part[3].size ? part[3].str[part[3].len - 1] : 0;
-        *print_prefix = lastc == '\n' || lastc == '\r';
+    if (local_use_color == 1)
+        esc = &esc_16[level];
+    else if (tint && use_color == 256)
+        esc = &esc_bg[level], fg = &esc_fg[tint];
+    else if (local_use_color == 256)
+        esc = &esc_256[level];
+    else
+        esc = NULL;
+
+    if (!esc) {
+        iov[0].iov_base = str;
+        iov[0].iov_len  = len;
+        return 1;
     }
+    iov[n].iov_base = (char *)esc->str;
+    iov[n].iov_len  = esc->len;
+    n++;
+    if (fg) {
+        iov[n].iov_base = (char *)fg->str;
+        iov[n].iov_len  = fg->len;
+        n++;
+    }
+    iov[n].iov_base = str;
+    iov[n].iov_len  = len;
+    n++;
+    iov[n].iov_base = (char *)esc_reset;
+    iov[n].iov_len  = sizeof(esc_reset) - 1;
+    return n + 1;
 }
+#endif
 
-void log_format_line(void *name, int level, const char *fmt, va_list vl,
-                        char *line, int line_size, int *print_prefix)
+/**
+ * Write all of iov to fd, retrying on short writes.
+ */
+int log_write_iov(int fd, struct iovec *iov, int iovcnt)
 {
-    log_format_line2(name, level, fmt, vl, line, line_size, print_prefix);
+    while (iovcnt > 0) {
+        ssize_t ret = writev(fd, iov, iovcnt);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        while (iovcnt && ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
 }
 
-int log_format_line2(void *name, int level, const char *fmt, va_list vl,
-                        char *line, int line_size, int *print_prefix)
+static int64_t buffer_clock(void)
 {
-    AVBPrint part[4];
-    int ret;
+    struct timespec ts;
 
-    format_line(name, level, fmt, vl, part, print_prefix, NULL);
-    ret = snprintf(line, line_size, "%s%s%s%s", part[0].str, part[1].str, part[2].str, part[3].str);
-    bprint_finalize(part+3, NULL);
-    return ret;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * INT64_C(1000) + ts.tv_nsec / 1000000;
 }
 
-void log_default_callback(void *name, int level, const char* fmt, va_list vl)
+/* log_write_iov() modifies the array */
+static int buffer_write_iov(int fd, const struct iovec *iov, int iovcnt)
 {
-    static int print_prefix = 1;
-    static int count;
-    static char prev[LINE_SZ];
-    AVBPrint part[4];
-    char line[LINE_SZ];
-    static int is_atty;
-    int type[2];
-    unsigned tint = 0;
+    struct iovec tmp[16];
+    int ret;
 
-    if (level >= 0) {
-        tint = level & 0xff00;
-        level &= 0xff;
+    while (iovcnt > 0) {
+        int n = FFMIN(iovcnt, 16);
+        memcpy(tmp, iov, n * sizeof(*tmp));
+        if ((ret = log_write_iov(fd, tmp, n)) < 0)
+            return ret;
+        iov    += n;
+        iovcnt -= n;
     }
+    return 0;
+}
 
-    if (level > log_level)
-        return;
+/* the buffered lines are discarded even if they could not be written */
+static int buffer_drain(LogBuffer *b)
+{
+    struct iovec iov = { b->data, b->len };
 
-	pthread_mutex_lock(&mutex);
-    format_line(name, level, fmt, vl, part, &print_prefix, type);
-    snprintf(line, sizeof(line), "%s%s%s%s", part[0].str, part[1].str, part[2].str, part[3].str);
+    if (!b->len)
+        return 0;
+    b->len   = 0;
+    b->dirty = 1;
+    return log_write_iov(b->fd, &iov, 1);
+}
 
-    if (!is_atty)
-        is_atty = isatty(2) ? 1 : -1;
+static void buffer_sync(LogBuffer *b, int64_t now)
+{
+    if (b->dirty)
+        fdatasync(b->fd);
+    b->dirty  = 0;
+    b->synced = now;
+}
 
-    if (print_prefix && (flags & LOG_SKIP_REPEATED) && !strcmp(line, prev) &&
-        *line && line[strlen(line) - 1] != '\r'){
-        count++;
-        if (is_atty == 1)
-            fprintf(stderr, "    Last message repeated %d times\r", count);
-        goto end;
-    }
-    if (count > 0) {
-        fprintf(stderr, "    Last message repeated %d times\n", count);
-        count = 0;
-    }
-    strcpy(prev, line);
-    sanitize(part[0].str);
-    colored_fputs(type[0], 0, part[0].str);
-    sanitize(part[1].str);
-    colored_fputs(type[1], 0, part[1].str);
-    sanitize(part[2].str);
-    colored_fputs(clip(level >> 3, 0, NB_LEVELS - 1), tint >> 8, part[2].str);
-    sanitize(part[3].str);
-    colored_fputs(clip(level >> 3, 0, NB_LEVELS - 1), tint >> 8, part[3].str);
+void log_buffer_init(LogBuffer *b, int fd)
+{
+    memset(b, 0, sizeof(*b));
+    b->fd                 = fd;
+    b->policy.flush_level = LOG_ERROR;
+}
 
-#if CONFIG_VALGRIND_BACKTRACE
-    if (level <= BACKTRACE_LOGLEVEL)
-        VALGRIND_PRINTF_BACKTRACE("%s", "");
-#endif
-end:
-    bprint_finalize(part+3, NULL);
+int log_buffer_set_policy(LogBuffer *b, const LogFlushPolicy *policy)
+{
+    char *data = NULL;
+
+    if (policy->max_delay < 0 || policy->sync_interval < 0)
+        return AVERROR(EINVAL);
+    if (policy->max_bytes && !(data = mem_malloc(policy->max_bytes)))
+        return AVERROR(ENOMEM);
 
-	pthread_mutex_unlock(&mutex);
+    log_buffer_flush(b);
+    mem_free(b->data);
+    b->data   = data;
+    b->policy = *policy;
+    b->synced = buffer_clock();
+    return 0;
 }
 
-static void (*log_callback)(void*, int, const char*, va_list) = log_default_callback;
+int log_buffer_write(LogBuffer *b, int level, const struct iovec *iov, int iovcnt)
+{
+    const LogFlushPolicy *p = &b->policy;
+    int64_t now = 0;
+    size_t total = 0;
+    int i, ret = 0;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if (!total)
+        return 0;
+    if (p->max_delay || p->sync_interval)
+        now = buffer_clock();
+
+    if (total > p->max_bytes - b->len) {
+        ret = buffer_drain(b);
+        /* lines which do not fit are written directly, no copy */
+        if (total > p->max_bytes) {
+            if (!ret)
+                ret = buffer_write_iov(b->fd, iov, iovcnt);
+            b->dirty = 1;
+            goto sync;
+        }
+    }
 
-void log(void *name, int level, const char *fmt, ...)
+    if (!b->len)
+        b->first = now;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(b->data + b->len, iov[i].iov_base, iov[i].iov_len);
+        b->len += iov[i].iov_len;
+    }
+    if (!ret && (level <= p->flush_level || (p->max_delay && now - b->first >= p->max_delay)))
+        ret = buffer_drain(b);
+
+sync:
+    if (p->sync_interval && now - b->synced >= p->sync_interval)
+        buffer_sync(b, now);
+    return ret;
+}
+
+void log_buffer_flush(LogBuffer *b)
 {
-    va_list vl;
-    va_start(vl, fmt);
-    vlog(name, level, fmt, vl);
-    va_end(vl);
+    buffer_drain(b);
+    if (b->policy.sync_interval)
+        buffer_sync(b, buffer_clock());
 }
 
-void log_once(void *name, int initial_level, int subsequent_level, int *state, const char *fmt, ...)
+void log_buffer_set_fd(LogBuffer *b, int fd)
 {
-    va_list vl;
-    va_start(vl, fmt);
-    vlog(name, *state ? subsequent_level : initial_level, fmt, vl);
-    va_end(vl);
-    *state = 1;
+    log_buffer_flush(b);
+    b->fd    = fd;
+    b->dirty = 0;
 }
 
-void vlog(void *name, int level, const char *fmt, va_list vl)
+void log_buffer_tick(LogBuffer *b)
 {
-#if 0
-    void (*log_callback)(void*, int, const char*, va_list) = log_callback;
-    if (log_callback){
-        log_callback(name, level, fmt, vl);
-    }
-#else
-    log_default_callback(name, level, fmt, vl);
-#endif
+    const LogFlushPolicy *p = &b->policy;
+    int64_t now;
+
+    if (!p->max_delay && !p->sync_interval)
+        return;
+    now = buffer_clock();
+    if (b->len && p->max_delay && now - b->first >= p->max_delay)
+        buffer_drain(b);
+    if (p->sync_interval && now - b->synced >= p->sync_interval)
+        buffer_sync(b, now);
 }
 
-int log_get_level(void)
+void log_buffer_uninit(LogBuffer *b)
 {
-    return log_level;
+    log_buffer_flush(b);
+    mem_free(b->data);
+    b->data = NULL;
 }
 
-void log_set_level(int level)
+static void write_str(int fd, const char *str, size_t len)
 {
+    struct iovec iov = { (char *)str, len };
+    log_write_iov(fd, &iov, 1);
+}
+
+/**
+ * Outputs of the default callback.
+ *
+ * A published list is never modified: changes build a new list, swap the
+ * pointer and free the old list once no caller can still be using it, so
+ * logging only has to take a reference. References are counted per epoch;
+ * the writer advances the epoch after the swap and waits for the count of
+ * the previous epoch to drop to zero.
+ */
+
+typedef struct LogOutput {
+    LogSink *sink;          ///< NULL for stderr
+    int level;              ///< highest level written to this output
+    int format;             ///< LOG_FORMAT_*
+} LogOutput;
+
+typedef struct OutputList {
+    int nb;
+    LogOutput out[];
+} OutputList;
+
+static OutputList default_outputs = { 1, { { NULL, INT_MAX, LOG_FORMAT_DEFAULT } } };
+
+static OutputList *_Atomic outputs = &default_outputs;
+static atomic_uint outputs_epoch;
+static atomic_int outputs_users[2];
+static pthread_mutex_t outputs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const OutputList *outputs_get(unsigned *epoch)
+{
+    unsigned e;
+
+    for (;;) {
+        e = atomic_load(&outputs_epoch);
+        atomic_fetch_add(&outputs_users[e & 1], 1);
+        if (atomic_load(&outputs_epoch) == e)
+            break;
+        atomic_fetch_sub(&outputs_users[e & 1], 1);
+    }
+    *epoch = e;
+    return atomic_load(&outputs);
+}
+
+static void outputs_put(unsigned epoch)
+{
+    atomic_fetch_sub(&outputs_users[epoch & 1], 1);
+}
+
+/**
+ * Replace the output list. Must be called with outputs_mutex held.
+ */
+static void outputs_publish(OutputList *list)
+{
+    OutputList *old = atomic_exchange(&outputs, list);
+    unsigned e = atomic_fetch_add(&outputs_epoch, 1);
+
+    while (atomic_load(&outputs_users[e & 1]))
+        sched_yield();
+    if (old != &default_outputs)
+        mem_free(old);
+}
+
+static int output_format(const LogOutput *out)
+{
+    if (out->format == LOG_FORMAT_DEFAULT)
+        return flags & LOG_PRINT_JSON ? LOG_FORMAT_JSON : LOG_FORMAT_TEXT;
+    return out->format;
+}
+
+/* stderr, protected by mutex */
+static LogBuffer stderr_buf = { .fd = 2, .policy = { .flush_level = LOG_ERROR } };
+
+/**
+ * @return the lock serializing the output to sink, NULL for stderr
+ */
+static pthread_mutex_t *output_lock(const LogSink *sink)
+{
+    return sink ? (pthread_mutex_t *)&sink->lock : &mutex;
+}
+
+static void output_write(const LogOutput *out, int level, struct iovec *iov, int iovcnt)
+{
+    if (out->sink)
+        out->sink->write(out->sink, level, iov, iovcnt);
+    else if (stderr_buf.policy.max_bytes || stderr_buf.policy.sync_interval)
+        log_buffer_write(&stderr_buf, level, iov, iovcnt);
+    else
+        log_write_iov(2, iov, iovcnt);
+}
+
+/**
+ * Replace the control characters other than \b \t \n \v \f \r in a
+ * formatted message by '?'.
+ *
+ * Messages are mostly plain text and can be several KB long, so there are
+ * SSE2 and AVX2 versions which test 16 or 32 bytes at once, selected at
+ * run time; the scalar version handles the tails.
+ */
+static void sanitize_c(uint8_t *line, size_t len)
+{
+    while (len--) {
+        if (*line < 0x08 || (*line > 0x0D && *line < 0x20))
+            *line = '?';
+        line++;
+    }
+}
+
+#if HAVE_X86_SIMD
+/* control characters are the bytes <= 0x1F, minus 0x08..0x0D */
+__attribute__((target("sse2")))
+static void sanitize_sse2(uint8_t *line, size_t len)
+{
+    const __m128i c1f = _mm_set1_epi8(0x1F), c08 = _mm_set1_epi8(0x08);
+    const __m128i c05 = _mm_set1_epi8(0x05), qm  = _mm_set1_epi8('?');
+
+    for (; len >= 16; len -= 16, line += 16) {
+        __m128i b    = _mm_loadu_si128((const __m128i *)line);
+        __m128i t    = _mm_sub_epi8(b, c08);
+        __m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(b, c1f), b);
+        ctrl = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_min_epu8(t, c05), t), ctrl);
+        if (_mm_movemask_epi8(ctrl))
+            _mm_storeu_si128((__m128i *)line,
+                             _mm_or_si128(_mm_andnot_si128(ctrl, b), _mm_and_si128(ctrl, qm)));
+    }
+    sanitize_c(line, len);
+}
+
+__attribute__((target("avx2")))
+static void sanitize_avx2(uint8_t *line, size_t len)
+{
+    const __m256i c1f = _mm256_set1_epi8(0x1F), c08 = _mm256_set1_epi8(0x08);
+    const __m256i c05 = _mm256_set1_epi8(0x05), qm  = _mm256_set1_epi8('?');
+
+    for (; len >= 32; len -= 32, line += 32) {
+        __m256i b    = _mm256_loadu_si256((const __m256i *)line);
+        __m256i t    = _mm256_sub_epi8(b, c08);
+        __m256i ctrl = _mm256_cmpeq_epi8(_mm256_min_epu8(b, c1f), b);
+        ctrl = _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(t, c05), t), ctrl);
+        if (_mm256_movemask_epi8(ctrl))
+            _mm256_storeu_si256((__m256i *)line,
+                                _mm256_or_si256(_mm256_andnot_si256(ctrl, b),
+                                                _mm256_and_si256(ctrl, qm)));
+    }
+    sanitize_sse2(line, len);
+}
+#endif
+
+static void (*sanitize_fn)(uint8_t *line, size_t len);
+
+static void sanitize(char *line, size_t len)
+{
+    void (*fn)(uint8_t *, size_t) = __atomic_load_n(&sanitize_fn, __ATOMIC_RELAXED);
+
+    /* short prefixes are not worth a call through a pointer */
+    if (len < 16) {
+        sanitize_c((uint8_t *)line, len);
+        return;
+    }
+    if (!fn) {
+        /* racing threads all pick the same function */
+        fn = sanitize_c;
+#if HAVE_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            fn = sanitize_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+            fn = sanitize_sse2;
+#endif
+        __atomic_store_n(&sanitize_fn, fn, __ATOMIC_RELAXED);
+    }
+    fn((uint8_t *)line, len);
+}
+
+static const char *get_level_str(int level)
+{
+    switch (level) {
+    case LOG_QUIET:
+        return "quiet";
+    case LOG_DEBUG:
+        return "debug";
+    case LOG_TRACE:
+        return "trace";
+    case LOG_VERBOSE:
+        return "verbose";
+    case LOG_INFO:
+        return "info";
+    case LOG_WARNING:
+        return "warning";
+    case LOG_ERROR:
+        return "error";
+    case LOG_FATAL:
+        return "fatal";
+    case LOG_PANIC:
+        return "panic";
+    default:
+        return "";
+    }
+}
+
+/**
+ * Date and time up to the second of the last timestamp of this thread, so
+ * that localtime_r() and strftime() only run once per second; only the
+ * fractional digits are formatted for every line.
+ */
+typedef struct TimeCache {
+    int64_t sec;
+    int monotonic;
+    int len;
+    char str[40];
+} TimeCache;
+
+static __thread TimeCache time_cache = { .sec = INT64_MIN };
+
+int log_format_time(char *buf, int size, int64_t time, int flags)
+{
+    TimeCache *c = &time_cache;
+    int64_t sec = time / 1000000000;
+    uint32_t frac = time % 1000000000;
+    int monotonic = !!(flags & LOG_TIME_MONOTONIC);
+    int digits = flags & LOG_TIME_NS ? 9 : 6;
+    char tmp[64];
+    int i, n;
+
+    if (frac >= 1000000000) {
+        /* negative times, round towards -infinity */
+        frac += 1000000000;
+        sec--;
+    }
+
+    if (sec != c->sec || monotonic != c->monotonic) {
+        if (monotonic) {
+            c->len = snprintf(c->str, sizeof(c->str), "%"PRId64, sec);
+        } else {
+            time_t t = sec;
+            struct tm tm;
+            c->len = localtime_r(&t, &tm) ?
+                     strftime(c->str, sizeof(c->str), "%Y-%m-%d %H:%M:%S", &tm) : 0;
+        }
+        c->sec       = sec;
+        c->monotonic = monotonic;
+    }
+
+    memcpy(tmp, c->str, c->len);
+    n = c->len;
+    tmp[n++] = '.';
+    if (digits == 6)
+        frac /= 1000;
+    for (i = digits - 1; i >= 0; i--, frac /= 10)
+        tmp[n + i] = '0' + frac % 10;
+    n += digits;
+    tmp[n++] = ' ';
+
+    if (size > 0) {
+        memcpy(buf, tmp, FFMIN(n, size - 1));
+        buf[FFMIN(n, size - 1)] = 0;
+    }
+    return n;
+}
+
+#define JSON_MAX_SIZE (4 * 65536)
+
+/**
+ * Key-value pairs of the log_kv() call being formatted by this thread.
+ */
+static __thread const LogKV *cur_kv;
+static __thread int cur_nb_kv;
+
+/**
+ * Append str as the contents of a JSON string, escaping it on the fly.
+ */
+static void bprint_json_escape(AVBPrint *buf, const char *str, size_t len)
+{
+    const char *run = str, *end = str + len;
+    char esc[8];
+
+    for (; str < end; str++) {
+        uint8_t c = *str;
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        bprint_append_data(buf, run, str - run);
+        switch (c) {
+        case '"':  bprint_append_data(buf, "\\\"", 2); break;
+        case '\\': bprint_append_data(buf, "\\\\", 2); break;
+        case '\n': bprint_append_data(buf, "\\n", 2);  break;
+        case '\r': bprint_append_data(buf, "\\r", 2);  break;
+        case '\t': bprint_append_data(buf, "\\t", 2);  break;
+        default:
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            bprint_append_data(buf, esc, 6);
+            break;
+        }
+        run = str + 1;
+    }
+    bprint_append_data(buf, run, end - run);
+}
+
+static void bprint_json_string(AVBPrint *buf, const char *str)
+{
+    bprint_append_data(buf, "\"", 1);
+    bprint_json_escape(buf, str, strlen(str));
+    bprint_append_data(buf, "\"", 1);
+}
+
+/**
+ * Append the value of a key-value pair, as JSON or in the key=value text
+ * form, where strings are only quoted if needed.
+ */
+static void bprint_kv_value(AVBPrint *buf, const LogKV *kv, int json)
+{
+    switch (kv->type) {
+    case LOG_KV_TYPE_INT:
+        bprintf(buf, "%"PRId64, kv->v.i);
+        break;
+    case LOG_KV_TYPE_UINT:
+        bprintf(buf, "%"PRIu64, kv->v.u);
+        break;
+    case LOG_KV_TYPE_DOUBLE:
+        /* JSON has no representation of NaN and infinities */
+        if (json && (kv->v.d != kv->v.d || kv->v.d - kv->v.d != 0))
+            bprint_append_data(buf, "null", 4);
+        else
+            bprintf(buf, "%.15g", kv->v.d);
+        break;
+    case LOG_KV_TYPE_BOOL:
+        if (kv->v.i)
+            bprint_append_data(buf, "true", 4);
+        else
+            bprint_append_data(buf, "false", 5);
+        break;
+    case LOG_KV_TYPE_STR:
+        if (!kv->v.s)
+            bprint_append_data(buf, "null", 4);
+        else if (json || !*kv->v.s || strpbrk(kv->v.s, " \"=\\\n\r\t"))
+            bprint_json_string(buf, kv->v.s);
+        else
+            bprint_append_data(buf, kv->v.s, strlen(kv->v.s));
+        break;
+    }
+}
+
+/**
+ * Format a whole message as one JSON object into out.
+ */
+static void format_json(void *name, int level, const char *fmt, va_list vl,
+                        AVBPrint *out)
+{
+    static __thread AVBPrint msg;
+    unsigned len;
+    int i;
+
+    bprint_init(out, 0, JSON_MAX_SIZE);
+    bprint_append_data(out, "{", 1);
+    if (flags & LOG_PRINT_TIME) {
+        struct timespec ts;
+        char buf[64];
+        int n;
+
+        clock_gettime(flags & LOG_TIME_MONOTONIC ? CLOCK_MONOTONIC : CLOCK_REALTIME, &ts);
+        n = log_format_time(buf, sizeof(buf),
+                            ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec, flags);
+        bprint_append_data(out, "\"time\":\"", 8);
+        bprint_append_data(out, buf, FFMIN(n, sizeof(buf) - 1) - 1);
+        bprint_append_data(out, "\",", 2);
+    }
+    bprintf(out, "\"level\":\"%s\"", get_level_str(level));
+    if (name) {
+        bprint_append_data(out, ",\"tag\":", 7);
+        bprint_json_string(out, name);
+    }
+
+    /* the message is formatted into a pooled buffer, then escaped */
+    bprint_init(&msg, 0, 65536);
+    vbprintf(&msg, fmt, vl);
+    len = FFMIN(msg.len, msg.size - 1);
+    while (len && (msg.str[len - 1] == '\n' || msg.str[len - 1] == '\r'))
+        len--;
+    bprint_append_data(out, ",\"msg\":\"", 8);
+    bprint_json_escape(out, msg.str, len);
+    bprint_append_data(out, "\"", 1);
+    bprint_finalize(&msg, NULL);
+
+    for (i = 0; i < cur_nb_kv; i++) {
+        bprint_append_data(out, ",", 1);
+        bprint_json_string(out, cur_kv[i].key);
+        bprint_append_data(out, ":", 1);
+        bprint_kv_value(out, &cur_kv[i], 1);
+    }
+    bprint_append_data(out, "}\n", 2);
+}
+
+static void format_line(void *name, int level, const char *fmt, va_list vl,
+                        AVBPrint part[4], int *print_prefix, int type[2])
+{
+    int i;
+
+    bprint_init(part+0, 0, BPRINT_SIZE_AUTOMATIC);
+    bprint_init(part+1, 0, BPRINT_SIZE_AUTOMATIC);
+    bprint_init(part+2, 0, BPRINT_SIZE_AUTOMATIC);
+    bprint_init(part+3, 0, 65536);
+
+    if(type) type[0] = type[1] = CLASS_CATEGORY_NA + 16;
+
+    if (*print_prefix && (flags & LOG_PRINT_TIME)) {
+        struct timespec ts;
+        char buf[64];
+        int n;
+
+        clock_gettime(flags & LOG_TIME_MONOTONIC ? CLOCK_MONOTONIC : CLOCK_REALTIME, &ts);
+        n = log_format_time(buf, sizeof(buf),
+                            ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec, flags);
+        bprint_append_data(part+0, buf, FFMIN(n, sizeof(buf) - 1));
+    }
+	if (*print_prefix && name) {
+		bprintf(part+1, "[%s @ %s] ", (char *)name, "reserve");
+	}
+    if (*print_prefix && (level > LOG_QUIET) && (flags & LOG_PRINT_LEVEL))
+        bprintf(part+2, "[%s] ", get_level_str(level));
+
+    vbprintf(part+3, fmt, vl);
+
+    for (i = 0; i < cur_nb_kv; i++) {
+        bprintf(part+3, " %s=", cur_kv[i].key);
+        bprint_kv_value(part+3, &cur_kv[i], 0);
+    }
+    if (cur_nb_kv)
+        bprint_append_data(part+3, "\n", 1);
+
+    if(*part[0].str || *part[1].str || *part[2].str || *part[3].str) {
+        char lastc = part[3].len && part[3].len <= part[3].size ? part[3].str[part[3].len - 1] : 0;
+        *print_prefix = lastc == '\n' || lastc == '\r';
+    }
+}
+
+void log_format_line(void *name, int level, const char *fmt, va_list vl,
+                        char *line, int line_size, int *print_prefix)
+{
+    log_format_line2(name, level, fmt, vl, line, line_size, print_prefix);
+}
+
+int log_format_line2(void *name, int level, const char *fmt, va_list vl,
+                        char *line, int line_size, int *print_prefix)
+{
+    AVBPrint part[4];
+    int ret;
+
+    if (flags & LOG_PRINT_JSON) {
+        format_json(name, level, fmt, vl, part);
+        ret = snprintf(line, line_size, "%s", part[0].str);
+        bprint_finalize(part, NULL);
+        return ret;
+    }
+    format_line(name, level, fmt, vl, part, print_prefix, NULL);
+    ret = snprintf(line, line_size, "%s%s%s%s", part[0].str, part[1].str, part[2].str, part[3].str);
+    bprint_finalize(part+3, NULL);
+    return ret;
+}
+
+/**
+ * Tag registry.
+ *
+ * Tags live in an open addressing hash table which only ever grows, so
+ * lookups can walk it without locking while insertions are serialized by
+ * tag_mutex. Each tag caches its effective level, so checking whether a
+ * message is enabled is a single load once the tag is known.
+ */
+
+#define MAX_TAGS 1024
+
+static LogTag *_Atomic tags[MAX_TAGS];
+static pthread_mutex_t tag_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LogTag default_tag = { "", LOG_INFO, 0, MAX_TAGS };
+
+static uint32_t tag_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    while (*name)
+        h = (h ^ (uint8_t)*name++) * 16777619u;
+    return h;
+}
+
+static LogTag *tag_find(const char *name, uint32_t h)
+{
+    unsigned i;
+
+    for (i = 0; i < MAX_TAGS; i++) {
+        LogTag *tag = atomic_load_explicit(&tags[(h + i) & (MAX_TAGS - 1)],
+                                           memory_order_acquire);
+        if (!tag)
+            break;
+        if (!strcmp(tag->name, name))
+            return tag;
+    }
+    return NULL;
+}
+
+/**
+ * Recompute log_threshold from log_level, the tag overrides and the
+ * recorder level. Must be called with tag_mutex held.
+ */
+static void update_threshold(void)
+{
+    int threshold = log_level;
+    unsigned i;
+
+    for (i = 0; i < MAX_TAGS; i++) {
+        LogTag *tag = atomic_load_explicit(&tags[i], memory_order_relaxed);
+        if (tag && tag->override)
+            threshold = FFMAX(threshold, tag->level);
+    }
+    __atomic_store_n(&output_threshold, threshold, __ATOMIC_RELAXED);
+    __atomic_store_n(&log_threshold, FFMAX(threshold, log_recorder_level), __ATOMIC_RELAXED);
+}
+
+LogTag *log_tag_get(const char *name)
+{
+    LogTag *tag;
+    uint32_t h;
+    unsigned i;
+
+    if (!name)
+        return &default_tag;
+
+    h = tag_hash(name);
+    if ((tag = tag_find(name, h)))
+        return tag;
+
+    pthread_mutex_lock(&tag_mutex);
+    if (!(tag = tag_find(name, h))) {
+        for (i = 0; i < MAX_TAGS; i++) {
+            LogTag *_Atomic *slot = &tags[(h + i) & (MAX_TAGS - 1)];
+            if (atomic_load_explicit(slot, memory_order_relaxed))
+                continue;
+            tag = mem_malloc(sizeof(*tag) + strlen(name) + 1);
+            if (tag) {
+                tag->name     = strcpy((char *)(tag + 1), name);
+                tag->level    = log_level;
+                tag->override = 0;
+                tag->index    = (h + i) & (MAX_TAGS - 1);
+                atomic_store_explicit(slot, tag, memory_order_release);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tag_mutex);
+
+    /* the table is full or we are out of memory, use the global level */
+    return tag ? tag : &default_tag;
+}
+
+/**
+ * Find the tag of a message logged through log().
+ * A small per thread cache maps name pointers to tags so that the usual
+ * case of a constant tag string costs no hashing, no string compare and
+ * no lock; log.h requires the string of a tag not to change.
+ */
+static LogTag *tag_lookup(const void *name)
+{
+    static __thread struct {
+        const void *name;
+        LogTag *tag;
+    } cache[64];
+    unsigned i = ((uintptr_t)name >> 3) & 63;
+
+    if (cache[i].tag && cache[i].name == name)
+        return cache[i].tag;
+    cache[i].name = name;
+    cache[i].tag  = log_tag_get(name);
+    return cache[i].tag;
+}
+
+/**
+ * Statistics.
+ *
+ * Every thread counts into its own ThreadStats with relaxed loads and
+ * stores, so counting costs no atomic read-modify-write and no shared
+ * cache line. The structures are chained in a list which log_get_stats()
+ * walks; those of exited threads are added to stats_retired and freed.
+ */
+
+typedef struct ThreadStats {
+    struct ThreadStats *prev, *next;
+    LogStats s;
+    uint64_t tags[MAX_TAGS + 1];    ///< messages per tag, by LogTag.index
+} ThreadStats;
+
+static ThreadStats stats_retired;
+static ThreadStats *stats_list;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static __thread ThreadStats *stats_cur;
+
+/* only the owning thread writes a counter */
+#define STAT_ADD(field, n) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+static void stats_add(uint64_t *dst, const uint64_t *src, size_t nb)
+{
+    size_t i;
+
+    for (i = 0; i < nb; i++)
+        dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+static void stats_thread_exit(void *arg)
+{
+    ThreadStats *st = arg;
+
+    pthread_mutex_lock(&stats_mutex);
+    stats_add((uint64_t *)&stats_retired.s, (const uint64_t *)&st->s,
+              sizeof(st->s) / sizeof(uint64_t));
+    stats_add(stats_retired.tags, st->tags, MAX_TAGS + 1);
+    if (st->next)
+        st->next->prev = st->prev;
+    if (st->prev)
+        st->prev->next = st->next;
+    else
+        stats_list = st->next;
+    pthread_mutex_unlock(&stats_mutex);
+
+    /* a later message from another destructor registers again */
+    stats_cur = NULL;
+    mem_free(st);
+}
+
+static void stats_init(void)
+{
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+/**
+ * @return the counters of the calling thread, NULL if out of memory
+ */
+static ThreadStats *thread_stats(void)
+{
+    ThreadStats *st = stats_cur;
+
+    if (__builtin_expect(!st, 0)) {
+        pthread_once(&stats_once, stats_init);
+        if (!(st = mem_mallocz(sizeof(*st))))
+            return NULL;
+        pthread_mutex_lock(&stats_mutex);
+        st->next = stats_list;
+        if (stats_list)
+            stats_list->prev = st;
+        stats_list = st;
+        pthread_mutex_unlock(&stats_mutex);
+        pthread_setspecific(stats_key, st);
+        stats_cur = st;
+    }
+    return st;
+}
+
+static int64_t stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void stats_hist(uint64_t *hist, int64_t ns)
+{
+    int i = ns > 0 ? FFMIN(64 - __builtin_clzll(ns), LOG_STATS_HIST_SIZE - 1) : 0;
+
+    STAT_ADD(hist[i], 1);
+}
+
+void log_stats_sink_dropped(uint64_t lines)
+{
+    ThreadStats *st = thread_stats();
+
+    if (st)
+        STAT_ADD(st->s.sink_dropped, lines);
+}
+
+void log_get_stats(LogStats *stats)
+{
+    const ThreadStats *st;
+
+    pthread_mutex_lock(&stats_mutex);
+    *stats = stats_retired.s;
+    for (st = stats_list; st; st = st->next)
+        stats_add((uint64_t *)stats, (const uint64_t *)&st->s,
+                  sizeof(*stats) / sizeof(uint64_t));
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void log_get_tag_stats(void (*callback)(void *opaque, const char *tag, uint64_t messages),
+                       void *opaque)
+{
+    uint64_t *counts = mem_malloc((MAX_TAGS + 1) * sizeof(*counts));
+    const ThreadStats *st;
+    unsigned i;
+
+    if (!counts)
+        return;
+    pthread_mutex_lock(&stats_mutex);
+    memcpy(counts, stats_retired.tags, (MAX_TAGS + 1) * sizeof(*counts));
+    for (st = stats_list; st; st = st->next)
+        stats_add(counts, st->tags, MAX_TAGS + 1);
+    pthread_mutex_unlock(&stats_mutex);
+
+    for (i = 0; i < MAX_TAGS; i++) {
+        LogTag *tag = atomic_load_explicit(&tags[i], memory_order_acquire);
+        if (tag && counts[i])
+            callback(opaque, tag->name, counts[i]);
+    }
+    if (counts[MAX_TAGS])
+        callback(opaque, NULL, counts[MAX_TAGS]);
+    mem_free(counts);
+}
+
+/**
+ * Repeat suppression.
+ *
+ * Every thread remembers its last few complete lines, found by a hash of
+ * their format string, tag, level and text; a line identical to one of them
+ * and seen again within REPEAT_INTERVAL is counted instead of being output,
+ * no matter how other threads' lines are interleaved with it. The hash only
+ * speeds up the search, the lines are compared before one is suppressed.
+ * Pending counts are reported before the thread's next line, and at least
+ * once per REPEAT_INTERVAL while the repetition goes on.
+ */
+
+#define REPEAT_SLOTS    8
+#define REPEAT_TEXT_SZ  80
+#define REPEAT_BUF_SZ   (REPEAT_SLOTS * (REPEAT_TEXT_SZ + 48))
+#define REPEAT_INTERVAL INT64_C(1000000000)
+
+typedef struct RepeatEntry {
+    uint64_t hash;
+    int64_t last_seen;
+    int64_t since;          ///< time of the first repetition not reported yet
+    unsigned count;
+    void *name;
+    const char *fmt;
+    int level;
+    unsigned len;
+    char line[LINE_SZ];     ///< the text as logged, len bytes
+    char text[REPEAT_TEXT_SZ]; ///< shortened line with its prefix, for reports
+} RepeatEntry;
+
+static __thread RepeatEntry repeat_tab[REPEAT_SLOTS];
+static __thread int repeat_last = -1;   ///< entry of the last line output
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    uint64_t w;
+
+    for (; size >= 8; size -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * UINT64_C(0x9e3779b97f4a7c15);
+        h ^= h >> 29;
+    }
+    w = 0;
+    memcpy(&w, p, size);
+    h = (h ^ w ^ size) * UINT64_C(0x9e3779b97f4a7c15);
+    return h ^ h >> 32;
+}
+
+static unsigned repeat_report(RepeatEntry *e, int last, char *buf, unsigned size)
+{
+    int ret;
+
+    if (last)
+        ret = snprintf(buf, size, "    Last message repeated %u times\n", e->count);
+    else
+        ret = snprintf(buf, size, "    Message repeated %u times: %s\n", e->count, e->text);
+    e->count = 0;
+    return ret < 0 ? 0 : FFMIN(ret, size - 1);
+}
+
+/**
+ * Check a formatted line against the recent lines of this thread.
+ *
+ * @param pre      receives the repeat counts to output before the line, or
+ *                 on their own if the line is suppressed
+ * @param pre_len  receives the length of pre
+ * @return 1 if the line must be suppressed, 0 otherwise
+ */
+static int repeat_check(void *name, int level, const char *fmt,
+                        AVBPrint part[4], int print_prefix,
+                        char *pre, unsigned *pre_len)
+{
+    const char *body = part[3].str;
+    unsigned len = FFMIN(part[3].len, part[3].size - 1);
+    struct timespec ts;
+    int64_t now;
+    uint64_t h;
+    int i, oldest = 0, eligible;
+
+    *pre_len = 0;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    now = ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+
+    /* only complete lines are considered, like the former strcmp() on the
+       whole line; progress lines ending in \r are never suppressed, nor
+       lines too long to be remembered whole */
+    eligible = print_prefix && len && len < LINE_SZ && body[len - 1] != '\r';
+    if (eligible) {
+        h = hash_bytes((uintptr_t)fmt ^ (uint64_t)(uintptr_t)name << 17 ^ level, body, len);
+        for (i = 0; i < REPEAT_SLOTS; i++) {
+            RepeatEntry *e = &repeat_tab[i];
+            if (e->last_seen && e->hash == h && e->name == name &&
+                e->fmt == fmt && e->level == level && e->len == len &&
+                !memcmp(e->line, body, len)) {
+                /* too old to be a repetition, the entry is reused */
+                if (now - e->last_seen > REPEAT_INTERVAL) {
+                    oldest = i;
+                    break;
+                }
+                if (!e->count++)
+                    e->since = now;
+                e->last_seen = now;
+                if (now - e->since >= REPEAT_INTERVAL) {
+                    *pre_len = repeat_report(e, i == repeat_last, pre, REPEAT_BUF_SZ);
+                    e->since = now;
+                }
+                return 1;
+            }
+            if (repeat_tab[i].last_seen < repeat_tab[oldest].last_seen)
+                oldest = i;
+        }
+    }
+
+    /* the line is output: report everything pending first */
+    if (repeat_last >= 0 && repeat_tab[repeat_last].count)
+        *pre_len += repeat_report(&repeat_tab[repeat_last], 1, pre, REPEAT_BUF_SZ);
+    for (i = 0; i < REPEAT_SLOTS; i++) {
+        if (repeat_tab[i].count)
+            *pre_len += repeat_report(&repeat_tab[i], 0, pre + *pre_len,
+                                      REPEAT_BUF_SZ - *pre_len);
+    }
+
+    if (!eligible) {
+        repeat_last = -1;
+        return 0;
+    }
+
+    repeat_tab[oldest].hash      = h;
+    repeat_tab[oldest].last_seen = now;
+    repeat_tab[oldest].count     = 0;
+    repeat_tab[oldest].name      = name;
+    repeat_tab[oldest].fmt       = fmt;
+    repeat_tab[oldest].level     = level;
+    repeat_tab[oldest].len       = len;
+    memcpy(repeat_tab[oldest].line, body, len);
+    snprintf(repeat_tab[oldest].text, REPEAT_TEXT_SZ, "%s%.*s", part[1].str,
+             len - (body[len - 1] == '\n'), body);
+    repeat_last = oldest;
+    return 0;
+}
+
+/**
+ * A formatted and sanitized message, in the formats the outputs need.
+ */
+typedef struct LogLine {
+    int level;
+    unsigned tint;
+    int type[2];
+    int formats;            ///< formats present, 1 << LOG_FORMAT_*
+    const char *pre;        ///< output without colors before the text, such as repeat counts
+    unsigned pre_len;
+    char *part[4];          ///< LOG_FORMAT_TEXT
+    unsigned len[4];
+    char *json;             ///< LOG_FORMAT_JSON
+    unsigned json_len;
+    int truncated;          ///< cut while formatting
+} LogLine;
+
+static void emit_text(const LogOutput *out, const LogLine *line)
+{
+    int level = line->level;
+    unsigned tint = line->tint;
+    const int *type = line->type;
+    char *const *part = line->part;
+    const unsigned *len = line->len;
+#if !(defined(_WIN32) && HAVE_SETCONSOLETEXTATTRIBUTE && HAVE_GETSTDHANDLE)
+    struct iovec iov[1 + 4 * 4];
+    int n = 0;
+#endif
+
+    if (out->sink) {
+        struct iovec plain[5];
+        int i, nb = 0;
+
+        if (line->pre_len) {
+            plain[nb].iov_base = (char *)line->pre;
+            plain[nb].iov_len  = line->pre_len;
+            nb++;
+        }
+        for (i = 0; i < 4; i++) {
+            plain[nb].iov_base = part[i];
+            plain[nb].iov_len  = len[i];
+            nb++;
+        }
+        output_write(out, level, plain, nb);
+        return;
+    }
+
+#if defined(_WIN32) && HAVE_SETCONSOLETEXTATTRIBUTE && HAVE_GETSTDHANDLE
+    if (line->pre_len)
+        fputs(line->pre, stderr);
+    colored_fputs(type[0], 0, part[0]);
+    colored_fputs(type[1], 0, part[1]);
+    colored_fputs(clip(level >> 3, 0, NB_LEVELS - 1), tint >> 8, part[2]);
+    colored_fputs(clip(level >> 3, 0, NB_LEVELS - 1), tint >> 8, part[3]);
+#else
+    /* the whole line, including pending repeat counts, goes out with a
+       single writev() so that it is not interleaved with other writers */
+    if (line->pre_len) {
+        iov[n].iov_base = (char *)line->pre;
+        iov[n].iov_len  = line->pre_len;
+        n++;
+    }
+    n += colored_iov(iov + n, type[0], 0, part[0], len[0]);
+    n += colored_iov(iov + n, type[1], 0, part[1], len[1]);
+    n += colored_iov(iov + n, clip(level >> 3, 0, NB_LEVELS - 1), tint >> 8, part[2], len[2]);
+    n += colored_iov(iov + n, clip(level >> 3, 0, NB_LEVELS - 1), tint >> 8, part[3], len[3]);
+    output_write(out, level, iov, n);
+#endif
+}
+
+/**
+ * Lock an output; if wait is not NULL, add the time spent waiting for the
+ * lock to it. The lock is tried first, so that an uncontended lock costs
+ * no clock read.
+ */
+static void output_lock_wait(const LogSink *sink, int64_t *wait)
+{
+    pthread_mutex_t *lock = output_lock(sink);
+    int64_t start;
+
+    if (!wait) {
+        pthread_mutex_lock(lock);
+    } else if (pthread_mutex_trylock(lock)) {
+        start = stats_clock();
+        pthread_mutex_lock(lock);
+        *wait += stats_clock() - start;
+    }
+}
+
+/**
+ * Write one message to every output which accepts its level.
+ * This is the only part of the default callback which must be serialized:
+ * the lock of each output is held while writing to it, so that a slow
+ * output does not hold up the lines written to the others.
+ * @param wait if not NULL, the time spent waiting for locks is added to it
+ * @return the number of bytes written
+ */
+static uint64_t log_emit(const OutputList *list, const LogLine *line, int64_t *wait)
+{
+    uint64_t bytes = 0;
+    int i;
+
+    for (i = 0; i < list->nb; i++) {
+        const LogOutput *out = &list->out[i];
+        int format = output_format(out);
+
+        if (line->level > out->level || !(line->formats & 1 << format))
+            continue;
+        output_lock_wait(out->sink, wait);
+        if (format == LOG_FORMAT_JSON) {
+            struct iovec iov = { line->json, line->json_len };
+            output_write(out, line->level, &iov, 1);
+            bytes += line->json_len;
+        } else {
+            emit_text(out, line);
+            bytes += line->pre_len + line->len[0] + line->len[1] +
+                     line->len[2] + line->len[3];
+        }
+        pthread_mutex_unlock(output_lock(out->sink));
+    }
+
+#if CONFIG_VALGRIND_BACKTRACE
+    if (line->level <= BACKTRACE_LOGLEVEL)
+        VALGRIND_PRINTF_BACKTRACE("%s", "");
+#endif
+    return bytes;
+}
+
+/**
+ * log_emit() and its accounting. With LOG_STATS_TIMING, the time spent
+ * waiting for the locks and writing is measured; the clock is read
+ * outside of the locks, except after waiting for one.
+ */
+static void emit_locked(const OutputList *list, const LogLine *line)
+{
+    ThreadStats *st = thread_stats();
+    int64_t wait = 0, start, end;
+    uint64_t bytes;
+
+    if (!(flags & LOG_STATS_TIMING) || !st) {
+        bytes = log_emit(list, line, NULL);
+        if (st)
+            STAT_ADD(st->s.bytes, bytes);
+        return;
+    }
+
+    start = stats_clock();
+    bytes = log_emit(list, line, &wait);
+    end = stats_clock();
+
+    STAT_ADD(st->s.bytes, bytes);
+    stats_hist(st->s.lock_wait, wait);
+    stats_hist(st->s.write_time, end - start - wait);
+}
+
+/**
+ * Write a line generated by the logging code itself to all outputs.
+ */
+static void emit_str(int level, const char *str, size_t len)
+{
+    const OutputList *list;
+    unsigned epoch;
+    int i;
+
+    list = outputs_get(&epoch);
+    for (i = 0; i < list->nb; i++) {
+        const LogOutput *out = &list->out[i];
+        struct iovec iov = { (char *)str, len };
+        char json[256];
+        AVBPrint buf;
+
+        if (level > out->level)
+            continue;
+        if (output_format(out) == LOG_FORMAT_JSON) {
+            const char *msg = str;
+            size_t msg_len = len;
+
+            /* without the indentation and the newline */
+            while (msg_len && *msg == ' ')
+                msg++, msg_len--;
+            while (msg_len && msg[msg_len - 1] == '\n')
+                msg_len--;
+            bprint_init_for_buffer(&buf, json, sizeof(json));
+            bprintf(&buf, "{\"level\":\"%s\",\"msg\":\"", get_level_str(level));
+            bprint_json_escape(&buf, msg, msg_len);
+            bprint_append_data(&buf, "\"}\n", 3);
+            iov.iov_base = buf.str;
+            iov.iov_len  = FFMIN(buf.len, buf.size - 1);
+        }
+        pthread_mutex_lock(output_lock(out->sink));
+        output_write(out, level, &iov, 1);
+        pthread_mutex_unlock(output_lock(out->sink));
+    }
+    outputs_put(epoch);
+}
+
+/******************************************************************************************************/
+
+/**
+ * Asynchronous mode.
+ *
+ * Producers format their message outside of any lock and publish it into a
+ * bounded multi-producer/single-consumer ring (one sequence number per slot,
+ * so claiming a slot is a single CAS). A dedicated writer thread drains the
+ * ring and performs the actual output. When the ring is full the message is
+ * dropped and accounted for rather than blocking the caller.
+ *
+ * Slots are small, lines which do not fit are spread over consecutive
+ * slots claimed with the same CAS, so that no line is cut and none costs
+ * an allocation; the writer joins them in a buffer of its own. Only lines
+ * too long for a quarter of the ring are copied into an allocated buffer
+ * freed by the writer. The writer sleeps for at most ASYNC_SLEEP_MS;
+ * producers only wake it up, which costs a system call, for errors and
+ * once the ring is filling up.
+ */
+
+#define SLOT_BUF_SZ    448
+#define ASYNC_SLEEP_MS 10
+
+typedef struct LogSlot {
+    atomic_size_t seq;
+    int level;
+    unsigned tint;
+    int type[2];
+    int formats;
+    unsigned len[6];        ///< pre, the 4 parts and json
+    unsigned nb_slots;      ///< slots from this one holding them in their buf
+    char *ext;              ///< holds them instead if there are too many slots
+    char buf[SLOT_BUF_SZ];  ///< all of them, 0-terminated
+} LogSlot;
+
+typedef struct LogQueue {
+    LogSlot *slots;
+    size_t mask;
+    atomic_size_t head;         ///< next slot to be claimed by a producer
+    atomic_size_t tail;         ///< next slot to be consumed by the writer
+    atomic_uint dropped;
+    atomic_int users;           ///< producers and log_flush() calls using the queue
+    atomic_int sleeping;
+    atomic_int stop;
+    char *line_buf;             ///< lines spread over slots are joined here by the writer
+    size_t line_size;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        ///< signalled to wake the writer up
+    pthread_cond_t drained;     ///< signalled by the writer after each batch
+} LogQueue;
+
+static LogQueue *_Atomic async_queue;
+
+static void async_wake(LogQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_signal(&q->wake);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Copy n bytes at offset off of the line in the slots claimed from pos,
+ * their buffers taken back to back, and advance off.
+ */
+static void async_copy(LogQueue *q, size_t pos, size_t *off, const char *src, size_t n)
+{
+    while (n) {
+        LogSlot *slot = &q->slots[(pos + *off / SLOT_BUF_SZ) & q->mask];
+        size_t o = *off % SLOT_BUF_SZ, chunk = FFMIN(n, SLOT_BUF_SZ - o);
+
+        memcpy(slot->buf + o, src, chunk);
+        src  += chunk;
+        *off += chunk;
+        n    -= chunk;
+    }
+}
+
+static int async_push(LogQueue *q, const LogLine *line)
+{
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    const char *src[6] = { line->pre, line->part[0], line->part[1],
+                           line->part[2], line->part[3], line->json };
+    unsigned len[6] = { line->pre_len, line->len[0], line->len[1],
+                        line->len[2], line->len[3], line->json_len };
+    LogSlot *slot;
+    size_t total = 6, nb_slots, off, k;
+    char *ext = NULL, *dst;
+    int i;
+
+    for (i = 0; i < 6; i++)
+        total += len[i];
+    nb_slots = (total + SLOT_BUF_SZ - 1) / SLOT_BUF_SZ;
+    if (nb_slots > (q->mask + 1) / 4 && nb_slots > 1) {
+        if (!(ext = mem_malloc(total)))
+            return AVERROR(ENOMEM);
+        nb_slots = 1;
+    }
+
+    for (;;) {
+        intptr_t diff;
+        slot = &q->slots[pos & q->mask];
+        diff = (intptr_t)atomic_load_explicit(&slot->seq, memory_order_acquire) -
+               (intptr_t)pos;
+        /* the following slots must be free as well, the CAS on head then
+           claims them all */
+        for (k = 1; !diff && k < nb_slots; k++)
+            diff = (intptr_t)atomic_load_explicit(&q->slots[(pos + k) & q->mask].seq,
+                                                  memory_order_acquire) -
+                   (intptr_t)(pos + k);
+        if (!diff) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + nb_slots,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            ThreadStats *st = thread_stats();
+            atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+            if (st)
+                STAT_ADD(st->s.dropped, 1);
+            mem_free(ext);
+            return AVERROR(EAGAIN);
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+
+    slot->level   = line->level;
+    slot->tint    = line->tint;
+    slot->type[0] = line->type[0];
+    slot->type[1] = line->type[1];
+    slot->formats  = line->formats;
+    slot->nb_slots = nb_slots;
+    slot->ext      = ext;
+    if (ext) {
+        dst = ext;
+        for (i = 0; i < 6; i++) {
+            if (len[i])
+                memcpy(dst, src[i], len[i]);
+            dst[len[i]] = 0;
+            dst += len[i] + 1;
+        }
+    } else {
+        for (i = 0, off = 0; i < 6; i++) {
+            async_copy(q, pos, &off, src[i], len[i]);
+            async_copy(q, pos, &off, "", 1);
+        }
+    }
+    for (i = 0; i < 6; i++)
+        slot->len[i] = len[i];
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    if (atomic_load_explicit(&q->sleeping, memory_order_relaxed) &&
+        (line->level <= LOG_ERROR ||
+         pos - atomic_load_explicit(&q->tail, memory_order_relaxed) >= (q->mask + 1) / 8) &&
+        atomic_exchange(&q->sleeping, 0))
+        async_wake(q);
+    return 0;
+}
+
+static int async_drain(LogQueue *q)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    const OutputList *list = NULL;
+    unsigned dropped, epoch;
+    int n = 0;
+
+    for (;;) {
+        LogSlot *slot = &q->slots[tail & q->mask];
+        size_t nb_slots, k;
+        LogLine line;
+        char *p;
+        int i;
+
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != tail + 1)
+            break;
+
+        nb_slots = slot->nb_slots;
+        p = slot->ext ? slot->ext : slot->buf;
+        if (nb_slots > 1) {
+            size_t size = nb_slots * SLOT_BUF_SZ;
+
+            if (size > q->line_size) {
+                if (!(p = mem_realloc(q->line_buf, size))) {
+                    atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+                    goto next;
+                }
+                q->line_buf  = p;
+                q->line_size = size;
+            }
+            for (k = 0; k < nb_slots; k++)
+                memcpy(q->line_buf + k * SLOT_BUF_SZ,
+                       q->slots[(tail + k) & q->mask].buf, SLOT_BUF_SZ);
+            p = q->line_buf;
+        }
+
+        line.level   = slot->level;
+        line.tint    = slot->tint;
+        line.type[0] = slot->type[0];
+        line.type[1] = slot->type[1];
+        line.formats = slot->formats;
+        line.pre     = p;
+        line.pre_len = slot->len[0];
+        p += slot->len[0] + 1;
+        for (i = 0; i < 4; i++) {
+            line.part[i] = p;
+            line.len[i]  = slot->len[i + 1];
+            p += line.len[i] + 1;
+        }
+        line.json     = p;
+        line.json_len = slot->len[5];
+
+        if (!list)
+            list = outputs_get(&epoch);
+        emit_locked(list, &line);
+next:
+        mem_free(slot->ext);
+
+        for (k = 0; k < nb_slots; k++)
+            atomic_store_explicit(&q->slots[(tail + k) & q->mask].seq,
+                                  tail + k + q->mask + 1, memory_order_release);
+        tail += nb_slots;
+        atomic_store_explicit(&q->tail, tail, memory_order_release);
+        n++;
+    }
+    if (list)
+        outputs_put(epoch);
+
+    dropped = atomic_exchange_explicit(&q->dropped, 0, memory_order_relaxed);
+    if (dropped) {
+        char msg[64];
+        int len = snprintf(msg, sizeof(msg), "    %u messages dropped, log queue full\n", dropped);
+        emit_str(LOG_WARNING, msg, len);
+    }
+    return n;
+}
+
+static void *async_thread(void *arg)
+{
+    LogQueue *q = arg;
+
+    for (;;) {
+        int stop = atomic_load(&q->stop);
+
+        if (async_drain(q))
+            continue;
+        if (stop)
+            break;
+
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_broadcast(&q->drained);
+        atomic_store(&q->sleeping, 1);
+        if (atomic_load(&q->head) == atomic_load(&q->tail) && !atomic_load(&q->stop)) {
+            /* producers only wake the writer up when in a hurry */
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += ASYNC_SLEEP_MS * 1000 * 1000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&q->wake, &q->lock, &ts);
+        }
+        atomic_store(&q->sleeping, 0);
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_broadcast(&q->drained);
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+static void async_stop(LogQueue *q)
+{
+    atomic_store(&q->stop, 1);
+    async_wake(q);
+    pthread_join(q->thread, NULL);
+    pthread_cond_destroy(&q->drained);
+    pthread_cond_destroy(&q->wake);
+    pthread_mutex_destroy(&q->lock);
+    mem_free(q->line_buf);
+    mem_free(q->slots);
+    mem_free(q);
+}
+
+static void async_atexit(void)
+{
+    log_set_async(0);
+}
+
+int log_set_async(unsigned queue_capacity)
+{
+    static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static int atexit_registered;
+    LogQueue *q = NULL, *old;
+    size_t size, i;
+    int ret = 0;
+
+    pthread_mutex_lock(&config_mutex);
+
+    if (queue_capacity) {
+        for (size = 2; size < queue_capacity && size <= SIZE_MAX / 4; size <<= 1)
+            ;
+        q = mem_mallocz(sizeof(*q));
+        if (!q || !(q->slots = mem_malloc(size * sizeof(*q->slots)))) {
+            mem_free(q);
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        q->mask = size - 1;
+        for (i = 0; i < size; i++)
+            atomic_init(&q->slots[i].seq, i);
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->wake, NULL);
+        pthread_cond_init(&q->drained, NULL);
+        if (pthread_create(&q->thread, NULL, async_thread, q)) {
+            pthread_cond_destroy(&q->drained);
+            pthread_cond_destroy(&q->wake);
+            pthread_mutex_destroy(&q->lock);
+            mem_free(q->slots);
+            mem_free(q);
+            ret = AVERROR(EAGAIN);
+            goto end;
+        }
+        if (!atexit_registered)
+            atexit_registered = !atexit(async_atexit);
+    }
+
+    /* messages published after the swap go to the new queue (or directly to
+       the output); the old writer drains what is left before exiting */
+    old = atomic_exchange(&async_queue, q);
+    if (old) {
+        while (atomic_load(&old->users))
+            sched_yield();
+        async_stop(old);
+    }
+
+end:
+    pthread_mutex_unlock(&config_mutex);
+    return ret;
+}
+
+static void async_flush(void)
+{
+    LogQueue *q;
+    size_t target;
+
+    /* hold a reference like producers do, so that log_set_async() does not
+       free the queue while waiting on it; its writer is still running
+       until the reference is released */
+    while ((q = atomic_load(&async_queue))) {
+        atomic_fetch_add(&q->users, 1);
+        if (q == atomic_load(&async_queue))
+            break;
+        atomic_fetch_sub(&q->users, 1);
+    }
+    if (!q)
+        return;
+
+    target = atomic_load(&q->head);
+    pthread_mutex_lock(&q->lock);
+    while ((intptr_t)(atomic_load(&q->tail) - target) < 0 && !atomic_load(&q->stop)) {
+        pthread_cond_signal(&q->wake);
+        pthread_cond_wait(&q->drained, &q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    atomic_fetch_sub(&q->users, 1);
+}
+
+/******************************************************************************************************/
+
+/**
+ * Binary mode.
+ *
+ * Messages are not formatted at all: they are recorded as references to
+ * their format string and tag, a timestamp and the raw argument bytes, see
+ * logbin.h. Format strings and tags are written out once, the first time
+ * they are used, so a format string must not change while it is in use.
+ * logdecode turns the stream back into text.
+ */
+
+#define BIN_BUF_SZ  65536
+#define BIN_REC_SZ  4096
+#define BIN_DICT_SZ 4096
+
+typedef struct BinDictEntry {
+    char *str;              ///< copy of the string, the caller's may change
+    size_t len;
+    uint64_t hash;
+    uint32_t id;
+} BinDictEntry;
+
+static pthread_mutex_t bin_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int bin_enabled;
+static int bin_fd = -1;
+static uint8_t bin_buf[BIN_BUF_SZ];
+static unsigned bin_len;
+static BinDictEntry bin_dict[BIN_DICT_SZ];
+static uint32_t bin_next_id;
+
+static void bin_flush_locked(void)
+{
+    write_str(bin_fd, (char *)bin_buf, bin_len);
+    bin_len = 0;
+}
+
+static void bin_append(const void *data, unsigned size)
+{
+    if (bin_len + size > BIN_BUF_SZ)
+        bin_flush_locked();
+    if (size > BIN_BUF_SZ) {
+        write_str(bin_fd, data, size);
+        return;
+    }
+    memcpy(bin_buf + bin_len, data, size);
+    bin_len += size;
+}
+
+/**
+ * Get the id of a format string or tag, defining it in the stream if it
+ * was not used before. Strings are looked up by their contents, so the
+ * caller may reuse its buffers. Must be called with bin_mutex held.
+ */
+static uint32_t bin_string_id(const char *str)
+{
+    size_t len = strlen(str);
+    uint64_t hash = hash_bytes(0, str, len);
+    unsigned i, h = hash & (BIN_DICT_SZ - 1);
+    BinDictEntry *e = NULL;
+    uint8_t def[9];
+    uint32_t id, len32 = len;
+
+    for (i = 0; i < 16; i++) {
+        e = &bin_dict[(h + i) & (BIN_DICT_SZ - 1)];
+        if (!e->str)
+            break;
+        if (e->hash == hash && e->len == len && !memcmp(e->str, str, len))
+            return e->id;
+    }
+
+    /* if the probe sequence is full or the copy cannot be allocated, the
+       string is simply defined again every time it is used */
+    id = ++bin_next_id;
+    if (!e->str && (e->str = mem_malloc(len + 1))) {
+        memcpy(e->str, str, len + 1);
+        e->len  = len;
+        e->hash = hash;
+        e->id   = id;
+    }
+    def[0] = LOGBIN_DEF;
+    memcpy(def + 1, &id, 4);
+    memcpy(def + 5, &len32, 4);
+    bin_append(def, sizeof(def));
+    bin_append(str, len);
+    return id;
+}
+
+#define BIN_PUT(type, val) do {                 \
+        type v_ = (val);                        \
+        if (n + sizeof(v_) > size)              \
+            return AVERROR(ENOSPC);             \
+        memcpy(dst + n, &v_, sizeof(v_));       \
+        n += sizeof(v_);                        \
+    } while (0)
+
+/**
+ * Serialize the arguments of fmt.
+ *
+ * @param lastc receives the last character of the formatted message, or
+ *              -1 if it would be empty
+ * @return the number of bytes written to dst, a negative error code if the
+ *         format string uses a conversion which cannot be recorded or the
+ *         arguments do not fit in size bytes
+ */
+static int bin_encode_args(uint8_t *dst, unsigned size, const char *fmt,
+                           va_list vl, int *lastc)
+{
+    LogBinSpec spec;
+    unsigned n = 0;
+    int64_t i;
+    uint64_t u;
+    const char *str;
+    uint32_t len;
+    int prec;
+
+    *lastc = -1;
+    while (logbin_next_spec(fmt, &spec)) {
+        if (spec.start > fmt)
+            *lastc = (uint8_t)spec.start[-1];
+        fmt = spec.end;
+
+        if (spec.star_width)
+            BIN_PUT(int64_t, va_arg(vl, int));
+        prec = spec.prec;
+        if (spec.star_prec) {
+            prec = va_arg(vl, int);
+            BIN_PUT(int64_t, prec);
+        }
+
+        switch (spec.type) {
+        case LOGBIN_ARG_NONE:
+            *lastc = '%';
+            break;
+        case LOGBIN_ARG_INT:
+            switch (spec.size) {
+            case LOGBIN_SIZE_LONG:    i = va_arg(vl, long);      break;
+            case LOGBIN_SIZE_LLONG:   i = va_arg(vl, long long); break;
+            case LOGBIN_SIZE_INTMAX:  i = va_arg(vl, intmax_t);  break;
+            case LOGBIN_SIZE_SIZE:    i = va_arg(vl, ssize_t);   break;
+            case LOGBIN_SIZE_PTRDIFF: i = va_arg(vl, ptrdiff_t); break;
+            default:                  i = va_arg(vl, int);       break;
+            }
+            BIN_PUT(int64_t, i);
+            *lastc = spec.end[-1] == 'c' ? (uint8_t)i : 0;
+            break;
+        case LOGBIN_ARG_UINT:
+            switch (spec.size) {
+            case LOGBIN_SIZE_LONG:    u = va_arg(vl, unsigned long);      break;
+            case LOGBIN_SIZE_LLONG:   u = va_arg(vl, unsigned long long); break;
+            case LOGBIN_SIZE_INTMAX:  u = va_arg(vl, uintmax_t);          break;
+            case LOGBIN_SIZE_SIZE:    u = va_arg(vl, size_t);             break;
+            case LOGBIN_SIZE_PTRDIFF: u = va_arg(vl, ptrdiff_t);          break;
+            default:                  u = va_arg(vl, unsigned);           break;
+            }
+            BIN_PUT(uint64_t, u);
+            *lastc = 0;
+            break;
+        case LOGBIN_ARG_PTR:
+            BIN_PUT(uint64_t, (uintptr_t)va_arg(vl, void *));
+            *lastc = 0;
+            break;
+        case LOGBIN_ARG_DOUBLE:
+            BIN_PUT(double, va_arg(vl, double));
+            *lastc = 0;
+            break;
+        case LOGBIN_ARG_LDOUBLE:
+            BIN_PUT(long double, va_arg(vl, long double));
+            *lastc = 0;
+            break;
+        case LOGBIN_ARG_STR:
+            str = va_arg(vl, const char *);
+            if (!str)
+                str = "(null)";
+            len = prec >= 0 ? strnlen(str, prec) : strlen(str);
+            if (n + 4 > size)
+                return AVERROR(ENOSPC);
+            /* long strings are truncated rather than failing the record */
+            len = FFMIN(len, size - n - 4);
+            BIN_PUT(uint32_t, len);
+            memcpy(dst + n, str, len);
+            n += len;
+            if (len)
+                *lastc = (uint8_t)str[len - 1];
+            break;
+        default:
+            return AVERROR(ENOSYS);
+        }
+    }
+    if (*fmt)
+        *lastc = (uint8_t)fmt[strlen(fmt) - 1];
+    return n;
+}
+
+static void bin_log(const char *name, int level, const char *fmt, va_list vl,
+                    int *print_prefix)
+{
+    static __thread uint8_t rec[BIN_REC_SZ];
+    uint8_t *args = rec + 1 + LOGBIN_MSG_HEADER_SIZE;
+    unsigned room = sizeof(rec) - 1 - LOGBIN_MSG_HEADER_SIZE;
+    struct timespec ts;
+    uint32_t size, fmt_id, tag_id;
+    int64_t time;
+    uint8_t prefix = *print_prefix;
+    int n, lastc;
+    va_list vl2;
+
+    clock_gettime(flags & LOG_TIME_MONOTONIC ? CLOCK_MONOTONIC : CLOCK_REALTIME, &ts);
+    time = ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+
+    va_copy(vl2, vl);
+    n = bin_encode_args(args, room, fmt, vl2, &lastc);
+    va_end(vl2);
+    if (n < 0) {
+        /* record the formatted text instead */
+        char *text = (char *)args + 4;
+        uint32_t len;
+        n = vsnprintf(text, room - 4, fmt, vl);
+        len = n < 0 ? 0 : FFMIN(n, room - 5);
+        memcpy(args, &len, 4);
+        lastc = len ? (uint8_t)text[len - 1] : -1;
+        n   = 4 + len;
+        fmt = "%s";
+    }
+
+    if (lastc >= 0 || (prefix && (name || (level > LOG_QUIET && (flags & LOG_PRINT_LEVEL)))))
+        *print_prefix = lastc == '\n' || lastc == '\r';
+
+    size = LOGBIN_MSG_HEADER_SIZE - 4 + n;
+    rec[0] = LOGBIN_MSG;
+    memcpy(rec + 1, &size, 4);
+    memcpy(rec + 13, &level, 4);
+    memcpy(rec + 17, &flags, 4);
+    rec[21] = prefix;
+    memcpy(rec + 22, &time, 8);
+
+    pthread_mutex_lock(&bin_mutex);
+    if (bin_fd >= 0) {
+        fmt_id = bin_string_id(fmt);
+        tag_id = name ? bin_string_id(name) : 0;
+        memcpy(rec + 5, &fmt_id, 4);
+        memcpy(rec + 9, &tag_id, 4);
+        bin_append(rec, 1 + 4 + size);
+    }
+    pthread_mutex_unlock(&bin_mutex);
+}
+
+static void bin_flush(void)
+{
+    pthread_mutex_lock(&bin_mutex);
+    if (bin_fd >= 0)
+        bin_flush_locked();
+    pthread_mutex_unlock(&bin_mutex);
+}
+
+static void bin_atexit(void)
+{
+    bin_flush();
+}
+
+int log_set_binary(const char *filename)
+{
+    static int atexit_registered;
+    int fd = -1;
+    unsigned i;
+
+    if (filename) {
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return AVERROR(errno);
+    }
+
+    pthread_mutex_lock(&bin_mutex);
+    if (bin_fd >= 0) {
+        bin_flush_locked();
+        close(bin_fd);
+    }
+    bin_fd      = fd;
+    bin_len     = 0;
+    bin_next_id = 0;
+    for (i = 0; i < BIN_DICT_SZ; i++)
+        mem_free(bin_dict[i].str);
+    memset(bin_dict, 0, sizeof(bin_dict));
+    if (fd >= 0) {
+        bin_append(LOGBIN_MAGIC, LOGBIN_MAGIC_SIZE);
+        if (!atexit_registered)
+            atexit_registered = !atexit(bin_atexit);
+    }
+    atomic_store(&bin_enabled, fd >= 0);
+    pthread_mutex_unlock(&bin_mutex);
+    return 0;
+}
+
+/******************************************************************************************************/
+
+/**
+ * Flight recorder.
+ *
+ * Messages up to the recorder level are stored, whether they are output or
+ * not, in a global ring of fixed size slots, in the binary format of
+ * logbin.h: only the format string pointer, the tag, a timestamp and the
+ * raw arguments are copied. Writers claim slots with one atomic increment
+ * and overwrite the oldest ones, a sequence number per slot tells readers
+ * whether its content is complete. Dumping only reads the ring, so it can
+ * be done from a signal handler; the result is a binary log for logdecode.
+ * The ring is referenced per epoch like the output list, by writers and by
+ * the signal handlers, so it is only freed once no handler can read it.
+ * Threads which record messages get an alternate signal stack while the
+ * handlers are installed, so that a stack overflow can still be dumped.
+ */
+
+#define REC_ARGS_SZ  (256 - 48)
+#define REC_STACK_SZ FFMAX(SIGSTKSZ, 65536)
+
+typedef struct RecSlot {
+    atomic_size_t seq;      ///< 2 * index + 1 while written, 2 * index + 2 once complete
+    const char *fmt;
+    const char *tag;
+    int32_t level;
+    int32_t flags;
+    int64_t time;
+    uint16_t len;           ///< bytes of args
+    uint8_t prefix;
+    uint8_t args[REC_ARGS_SZ];
+} RecSlot;
+
+typedef struct Recorder {
+    RecSlot *slots;
+    size_t mask;
+    atomic_size_t head;     ///< index of the next slot to be written
+} Recorder;
+
+static Recorder *_Atomic recorder;
+static atomic_uint rec_epoch;
+static atomic_int rec_users[2];
+static char rec_path[PATH_MAX];
+static const int rec_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+static struct sigaction rec_old_actions[FF_ARRAY_ELEMS(rec_signals)];
+static int rec_handlers_installed;
+static pthread_mutex_t rec_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int rec_stack_done;     ///< rec_altstack() was called by the thread
+static pthread_key_t rec_stack_key;
+static pthread_once_t rec_stack_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Take a reference to the ring, safe in a signal handler.
+ */
+static Recorder *rec_get(unsigned *epoch)
+{
+    unsigned e;
+
+    for (;;) {
+        e = atomic_load(&rec_epoch);
+        atomic_fetch_add(&rec_users[e & 1], 1);
+        if (atomic_load(&rec_epoch) == e)
+            break;
+        atomic_fetch_sub(&rec_users[e & 1], 1);
+    }
+    *epoch = e;
+    return atomic_load(&recorder);
+}
+
+static void rec_put(unsigned epoch)
+{
+    atomic_fetch_sub(&rec_users[epoch & 1], 1);
+}
+
+static void rec_stack_release(void *arg)
+{
+    stack_t ss = { .ss_flags = SS_DISABLE };
+
+    sigaltstack(&ss, NULL);
+    mem_free(arg);
+}
+
+static void rec_stack_init(void)
+{
+    pthread_key_create(&rec_stack_key, rec_stack_release);
+}
+
+/**
+ * Give the calling thread an alternate signal stack, unless it has one
+ * already. It is released when the thread exits.
+ */
+static void rec_altstack(void)
+{
+    stack_t ss = { .ss_size = REC_STACK_SZ }, old;
+
+    rec_stack_done = 1;
+    if (sigaltstack(NULL, &old) < 0 || !(old.ss_flags & SS_DISABLE))
+        return;
+    pthread_once(&rec_stack_once, rec_stack_init);
+    if (!(ss.ss_sp = mem_malloc(ss.ss_size)))
+        return;
+    if (sigaltstack(&ss, NULL) < 0) {
+        mem_free(ss.ss_sp);
+        return;
+    }
+    pthread_setspecific(rec_stack_key, ss.ss_sp);
+}
+
+static void recorder_log(const char *name, int level, const char *fmt, va_list vl)
+{
+    static __thread int print_prefix = 1;
+    Recorder *r;
+    RecSlot *slot;
+    struct timespec ts;
+    unsigned epoch;
+    size_t i;
+    int n, lastc, prefix = print_prefix;
+    va_list vl2;
+
+    clock_gettime(flags & LOG_TIME_MONOTONIC ? CLOCK_MONOTONIC : CLOCK_REALTIME, &ts);
+
+    if (__builtin_expect(!rec_stack_done, 0) &&
+        __atomic_load_n(&rec_handlers_installed, __ATOMIC_RELAXED))
+        rec_altstack();
+
+    if (!(r = rec_get(&epoch))) {
+        rec_put(epoch);
+        return;
+    }
+
+    i    = atomic_fetch_add_explicit(&r->head, 1, memory_order_relaxed);
+    slot = &r->slots[i & r->mask];
+    atomic_store_explicit(&slot->seq, 2 * i + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    va_copy(vl2, vl);
+    n = bin_encode_args(slot->args, REC_ARGS_SZ, fmt, vl2, &lastc);
+    va_end(vl2);
+    if (n < 0) {
+        /* record the formatted text instead */
+        char *text = (char *)slot->args + 4;
+        uint32_t len;
+        n = vsnprintf(text, REC_ARGS_SZ - 4, fmt, vl);
+        len = n < 0 ? 0 : FFMIN(n, REC_ARGS_SZ - 5);
+        memcpy(slot->args, &len, 4);
+        lastc = len ? (uint8_t)text[len - 1] : -1;
+        n   = 4 + len;
+        fmt = "%s";
+    }
+    if (lastc >= 0 || (prefix && (name || (level > LOG_QUIET && (flags & LOG_PRINT_LEVEL)))))
+        print_prefix = lastc == '\n' || lastc == '\r';
+
+    slot->fmt    = fmt;
+    slot->tag    = name ? tag_lookup(name)->name : NULL;
+    if (slot->tag && !slot->tag[0])
+        slot->tag = NULL;
+    slot->level  = level;
+    slot->flags  = flags;
+    slot->time   = ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+    slot->len    = n;
+    slot->prefix = prefix;
+    atomic_store_explicit(&slot->seq, 2 * i + 2, memory_order_release);
+
+    rec_put(epoch);
+}
+
+typedef struct RecWriter {
+    int fd;
+    unsigned len;
+    char buf[4096];
+} RecWriter;
+
+static void rec_flush(RecWriter *w)
+{
+    write_str(w->fd, w->buf, w->len);
+    w->len = 0;
+}
+
+static void rec_append(RecWriter *w, const void *data, size_t size)
+{
+    if (w->len + size > sizeof(w->buf))
+        rec_flush(w);
+    if (size > sizeof(w->buf)) {
+        write_str(w->fd, data, size);
+        return;
+    }
+    memcpy(w->buf + w->len, data, size);
+    w->len += size;
+}
+
+static void rec_define(RecWriter *w, uint32_t id, const char *str)
+{
+    uint32_t len = strlen(str);
+    uint8_t def[9];
+
+    def[0] = LOGBIN_DEF;
+    memcpy(def + 1, &id, 4);
+    memcpy(def + 5, &len, 4);
+    rec_append(w, def, sizeof(def));
+    rec_append(w, str, len);
+}
+
+/**
+ * Write the content of the ring to fd as a binary log, oldest first.
+ * Only uses async-signal-safe functions.
+ */
+static void recorder_dump_fd(Recorder *r, int fd)
+{
+    RecWriter w = { fd, 0 };
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t i    = head > r->mask ? head - r->mask - 1 : 0;
+    RecSlot copy;
+
+    rec_append(&w, LOGBIN_MAGIC, LOGBIN_MAGIC_SIZE);
+    for (; i < head; i++) {
+        RecSlot *slot = &r->slots[i & r->mask];
+        uint8_t rec[1 + LOGBIN_MSG_HEADER_SIZE];
+        uint32_t size, fmt_id = 1, tag_id;
+
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != 2 * i + 2)
+            continue;
+        memcpy(&copy.fmt, &slot->fmt, sizeof(copy) - offsetof(RecSlot, fmt));
+        atomic_thread_fence(memory_order_acquire);
+        /* overwritten while copying */
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != 2 * i + 2)
+            continue;
+
+        /* every record redefines ids 1 and 2, which keeps the dump free
+           of any lookup table */
+        tag_id = copy.tag ? 2 : 0;
+        rec_define(&w, fmt_id, copy.fmt);
+        if (copy.tag)
+            rec_define(&w, tag_id, copy.tag);
+
+        size = LOGBIN_MSG_HEADER_SIZE - 4 + copy.len;
+        rec[0] = LOGBIN_MSG;
+        memcpy(rec + 1,  &size,        4);
+        memcpy(rec + 5,  &fmt_id,      4);
+        memcpy(rec + 9,  &tag_id,      4);
+        memcpy(rec + 13, &copy.level,  4);
+        memcpy(rec + 17, &copy.flags,  4);
+        rec[21] = copy.prefix;
+        memcpy(rec + 22, &copy.time,   8);
+        rec_append(&w, rec, sizeof(rec));
+        rec_append(&w, copy.args, copy.len);
+    }
+    rec_flush(&w);
+}
+
+static void recorder_signal(int sig)
+{
+    unsigned epoch;
+    Recorder *r = rec_get(&epoch);
+    int fd, i;
+
+    if (r && rec_path[0] &&
+        (fd = open(rec_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0) {
+        recorder_dump_fd(r, fd);
+        close(fd);
+    }
+    rec_put(epoch);
+
+    /* let the previous handler or the default action finish the job */
+    for (i = 0; i < FF_ARRAY_ELEMS(rec_signals); i++)
+        if (rec_signals[i] == sig)
+            sigaction(sig, &rec_old_actions[i], NULL);
+    raise(sig);
+}
+
+static void recorder_set_handlers(int install)
+{
+    struct sigaction sa = { 0 };
+    int i;
+
+    if (install == rec_handlers_installed)
+        return;
+    if (install)
+        rec_altstack();
+    sa.sa_handler = recorder_signal;
+    sa.sa_flags   = SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    for (i = 0; i < FF_ARRAY_ELEMS(rec_signals); i++) {
+        if (install)
+            sigaction(rec_signals[i], &sa, &rec_old_actions[i]);
+        else
+            sigaction(rec_signals[i], &rec_old_actions[i], NULL);
+    }
+    __atomic_store_n(&rec_handlers_installed, install, __ATOMIC_RELAXED);
+}
+
+int log_set_recorder(int level, size_t size, const char *filename)
+{
+    Recorder *r = NULL, *old;
+    size_t nb = 16;
+    unsigned e;
+
+    if (filename && strlen(filename) >= sizeof(rec_path))
+        return AVERROR(ENAMETOOLONG);
+
+    if (size) {
+        while (nb * 2 * sizeof(RecSlot) <= size)
+            nb *= 2;
+        if (!(r = mem_mallocz(sizeof(*r))) ||
+            !(r->slots = mem_mallocz(nb * sizeof(*r->slots)))) {
+            mem_free(r);
+            return AVERROR(ENOMEM);
+        }
+        r->mask = nb - 1;
+    }
+
+    pthread_mutex_lock(&rec_mutex);
+    /* the handlers only read the path once the ring is published */
+    recorder_set_handlers(0);
+    rec_path[0] = 0;
+    old = atomic_exchange(&recorder, r);
+    e   = atomic_fetch_add(&rec_epoch, 1);
+    while (atomic_load(&rec_users[e & 1]))
+        sched_yield();
+    if (old) {
+        mem_free(old->slots);
+        mem_free(old);
+    }
+    if (r && filename) {
+        strcpy(rec_path, filename);
+        recorder_set_handlers(1);
+    }
+    pthread_mutex_unlock(&rec_mutex);
+
+    pthread_mutex_lock(&tag_mutex);
+    __atomic_store_n(&log_recorder_level, r ? level : INT_MIN, __ATOMIC_RELAXED);
+    update_threshold();
+    pthread_mutex_unlock(&tag_mutex);
+    return 0;
+}
+
+int log_dump_recorder(const char *filename)
+{
+    Recorder *r;
+    int fd, ret = 0;
+
+    pthread_mutex_lock(&rec_mutex);
+    if (!filename)
+        filename = rec_path;
+    if (!(r = atomic_load(&recorder)) || !filename[0]) {
+        pthread_mutex_unlock(&rec_mutex);
+        return AVERROR(EINVAL);
+    }
+    if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        ret = AVERROR(errno);
+    } else {
+        recorder_dump_fd(r, fd);
+        close(fd);
+    }
+    pthread_mutex_unlock(&rec_mutex);
+    return ret;
+}
+
+void log_flush(void)
+{
+    const OutputList *list;
+    unsigned epoch;
+    int i;
+
+    async_flush();
+    bin_flush();
+
+    list = outputs_get(&epoch);
+    for (i = 0; i < list->nb; i++) {
+        LogSink *sink = list->out[i].sink;
+        if (sink && sink->flush) {
+            pthread_mutex_lock(&sink->lock);
+            sink->flush(sink);
+            pthread_mutex_unlock(&sink->lock);
+        }
+    }
+    outputs_put(epoch);
+    pthread_mutex_lock(&mutex);
+    log_buffer_flush(&stderr_buf);
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Rate limit summaries.
+ *
+ * Call sites of LOG_RATELIMIT() which dropped messages are added to a list
+ * once, so that the flush thread can report them even if no message of
+ * the site is let through anymore.
+ */
+
+#define RATELIMIT_REPORT_MS 1000
+
+static LogRateLimit *_Atomic ratelimit_sites;
+
+static void ratelimit_report(LogRateLimit *rl, void *name, int level, int64_t now)
+{
+    unsigned suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&rl->reported, now, __ATOMIC_RELAXED);
+    if (suppressed)
+        log(name, level, "    %u messages suppressed by rate limit\n", suppressed);
+}
+
+/**
+ * Report the sites which dropped messages and logged no summary for
+ * RATELIMIT_REPORT_MS, or all of them if final is set.
+ */
+static void ratelimit_tick(int final)
+{
+    struct timespec ts;
+    LogRateLimit *rl;
+    int64_t now;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+
+    for (rl = atomic_load(&ratelimit_sites); rl; rl = rl->next) {
+        if (__atomic_load_n(&rl->suppressed, __ATOMIC_RELAXED) &&
+            (final || now - __atomic_load_n(&rl->reported, __ATOMIC_RELAXED) >=
+                      RATELIMIT_REPORT_MS * INT64_C(1000000)))
+            ratelimit_report(rl, rl->name, rl->level, now);
+    }
+}
+
+static atomic_int tick_period;  ///< ms between two ticks of the flush thread
+
+static void *flush_thread(void *arg)
+{
+    for (;;) {
+        int period = atomic_load(&tick_period);
+        struct timespec ts = { period / 1000, period % 1000 * 1000000 };
+        const OutputList *list;
+        unsigned epoch;
+        int i;
+
+        nanosleep(&ts, NULL);
+        ratelimit_tick(0);
+
+        list = outputs_get(&epoch);
+        for (i = 0; i < list->nb; i++) {
+            LogSink *sink = list->out[i].sink;
+            if (sink && sink->tick) {
+                pthread_mutex_lock(&sink->lock);
+                sink->tick(sink);
+                pthread_mutex_unlock(&sink->lock);
+            }
+        }
+        outputs_put(epoch);
+        pthread_mutex_lock(&mutex);
+        log_buffer_tick(&stderr_buf);
+        pthread_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+static void flush_atexit(void)
+{
+    ratelimit_tick(1);
+    log_flush();
+}
+
+/**
+ * Register the final flush and, if period is not 0, make the flush thread
+ * tick at least every period ms, starting it if needed.
+ */
+static void flush_thread_start(int period)
+{
+    static pthread_mutex_t start_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static int started, atexit_registered;
+    int cur;
+
+    pthread_mutex_lock(&start_mutex);
+    if (!atexit_registered)
+        atexit_registered = !atexit(flush_atexit);
+    cur = atomic_load(&tick_period);
+    if (period && (!cur || period < cur))
+        atomic_store(&tick_period, period);
+    if (period && !started) {
+        pthread_attr_t attr;
+        pthread_t thread;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        started = !pthread_create(&thread, &attr, flush_thread, NULL);
+        pthread_attr_destroy(&attr);
+    }
+    pthread_mutex_unlock(&start_mutex);
+}
+
+int log_sink_set_flush_policy(LogSink *sink, const LogFlushPolicy *policy)
+{
+    int ret, period = INT_MAX;
+
+    if (sink && !sink->set_flush_policy)
+        return AVERROR(ENOSYS);
+
+    pthread_mutex_lock(output_lock(sink));
+    if (!sink)
+        ret = log_buffer_set_policy(&stderr_buf, policy);
+    else
+        ret = sink->set_flush_policy(sink, policy);
+    pthread_mutex_unlock(output_lock(sink));
+
+    if (ret >= 0) {
+        /* ticking twice per limit keeps lines at most 1.5 limits late */
+        if (policy->max_delay)
+            period = FFMIN(period, policy->max_delay / 2);
+        if (policy->sync_interval)
+            period = FFMIN(period, policy->sync_interval / 2);
+        flush_thread_start(period == INT_MAX ? 0 : FFMAX(period, 1));
+    }
+    return ret;
+}
+
+/**
+ * Publish a copy of the current list with the output of sink replaced by
+ * out, removed if out is NULL, or added if missing.
+ */
+static int outputs_update(LogSink *sink, const LogOutput *out)
+{
+    const OutputList *cur;
+    OutputList *list;
+    int i, nb = 0;
+
+    pthread_mutex_lock(&outputs_mutex);
+    cur = atomic_load(&outputs);
+    list = mem_malloc(sizeof(*list) + (cur->nb + 1) * sizeof(*list->out));
+    if (!list) {
+        pthread_mutex_unlock(&outputs_mutex);
+        return AVERROR(ENOMEM);
+    }
+    for (i = 0; i < cur->nb; i++) {
+        if (cur->out[i].sink != sink)
+            list->out[nb++] = cur->out[i];
+        else if (out)
+            list->out[nb++] = *out, out = NULL;
+    }
+    if (out)
+        list->out[nb++] = *out;
+    list->nb = nb;
+    outputs_publish(list);
+    pthread_mutex_unlock(&outputs_mutex);
+    return 0;
+}
+
+int log_add_sink(LogSink *sink, int level, int format)
+{
+    LogOutput out = { sink, level, format };
+
+    if (format < LOG_FORMAT_DEFAULT || format > LOG_FORMAT_JSON)
+        return AVERROR(EINVAL);
+    /* sinks may buffer below LOG_ERROR without any flush policy set */
+    if (sink)
+        flush_thread_start(0);
+    return outputs_update(sink, &out);
+}
+
+int log_remove_sink(LogSink *sink)
+{
+    /* queued messages still go to the sink */
+    async_flush();
+    return outputs_update(sink, NULL);
+}
+
+void log_set_sink(LogSink *sink)
+{
+    OutputList *list = &default_outputs;
+
+    if (sink) {
+        if (!(list = mem_malloc(sizeof(*list) + sizeof(*list->out))))
+            return;
+        list->nb     = 1;
+        list->out[0] = (LogOutput){ sink, INT_MAX, LOG_FORMAT_DEFAULT };
+        flush_thread_start(0);
+    }
+    pthread_mutex_lock(&outputs_mutex);
+    outputs_publish(list);
+    pthread_mutex_unlock(&outputs_mutex);
+}
+
+void log_sink_close(LogSink **sink)
+{
+    if (!*sink)
+        return;
+
+    log_remove_sink(*sink);
+    pthread_mutex_destroy(&(*sink)->lock);
+    (*sink)->close(*sink);
+    *sink = NULL;
+}
+
+void log_default_callback(void *name, int level, const char* fmt, va_list vl)
+{
+    /* per thread scratch space, so that formatting needs no lock; the prefix
+       state is per thread too as a partial line can only be continued by the
+       thread which started it */
+    static __thread int print_prefix = 1;
+    static __thread AVBPrint part[4], json;
+    static __thread char pre[REPEAT_BUF_SZ];
+    const OutputList *list;
+    LogLine line = { 0 };
+    ThreadStats *st;
+    LogTag *tag;
+    unsigned epoch;
+    LogQueue *q;
+    va_list vl2;
+    int i;
+
+    line.pre = pre;
+    if (level >= 0) {
+        line.tint = level & 0xff00;
+        level &= 0xff;
+    }
+    line.level = level;
+
+    tag = tag_lookup(name);
+    if (level > __atomic_load_n(&tag->level, __ATOMIC_RELAXED))
+        return;
+
+    if ((st = thread_stats())) {
+        if (level >= 0)
+            STAT_ADD(st->s.messages[clip(level >> 3, 0, NB_LEVELS - 1)], 1);
+        STAT_ADD(st->tags[name ? tag->index : MAX_TAGS], 1);
+    }
+
+    if (atomic_load_explicit(&bin_enabled, memory_order_relaxed)) {
+        bin_log(name, level, fmt, vl, &print_prefix);
+        return;
+    }
+
+    /* every format any output needs is produced once */
+    list = outputs_get(&epoch);
+    for (i = 0; i < list->nb; i++)
+        if (level <= list->out[i].level)
+            line.formats |= 1 << output_format(&list->out[i]);
+    if (!line.formats)
+        goto end;
+
+    if (line.formats & 1 << LOG_FORMAT_TEXT) {
+        va_copy(vl2, vl);
+        format_line(name, level, fmt, vl2, part, &print_prefix, line.type);
+        va_end(vl2);
+        for (i = 0; i < 4; i++) {
+            line.part[i] = part[i].str;
+            line.len[i]  = FFMIN(part[i].len, part[i].size - 1);
+            line.truncated |= line.len[i] < part[i].len;
+            sanitize(line.part[i], line.len[i]);
+        }
+    }
+    if (line.formats & 1 << LOG_FORMAT_JSON) {
+        va_copy(vl2, vl);
+        format_json(name, level, fmt, vl2, &json);
+        va_end(vl2);
+        line.json     = json.str;
+        line.json_len = FFMIN(json.len, json.size - 1);
+        line.truncated |= line.json_len < json.len;
+    }
+    if (line.truncated && st)
+        STAT_ADD(st->s.truncated, 1);
+
+    /* repeats are only suppressed when every output is text */
+    if ((flags & LOG_SKIP_REPEATED) && line.formats == 1 << LOG_FORMAT_TEXT &&
+        repeat_check(name, level, fmt, part, print_prefix, pre, &line.pre_len)) {
+        if (st)
+            STAT_ADD(st->s.repeated, 1);
+        if (!line.pre_len)
+            goto end;
+        /* periodic report of an ongoing repetition */
+        line.len[0] = line.len[1] = line.len[2] = line.len[3] = 0;
+    }
+
+    while ((q = atomic_load(&async_queue))) {
+        atomic_fetch_add(&q->users, 1);
+        if (q != atomic_load(&async_queue)) {
+            /* raced with log_set_async(), retry with the new queue */
+            atomic_fetch_sub(&q->users, 1);
+            continue;
+        }
+        i = async_push(q, &line);
+        atomic_fetch_sub(&q->users, 1);
+        /* out of memory for a long line, write it directly */
+        if (i != AVERROR(ENOMEM))
+            goto end;
+        break;
+    }
+
+    emit_locked(list, &line);
+
+end:
+    outputs_put(epoch);
+    if (line.formats & 1 << LOG_FORMAT_TEXT)
+        bprint_finalize(part+3, NULL);
+    if (line.formats & 1 << LOG_FORMAT_JSON)
+        bprint_finalize(&json, NULL);
+}
+
+static void (*log_callback)(void*, int, const char*, va_list) = log_default_callback;
+
+void log(void *name, int level, const char *fmt, ...)
+{
+    va_list vl;
+
+    if (!log_level_enabled(level))
+        return;
+    va_start(vl, fmt);
+    vlog(name, level, fmt, vl);
+    va_end(vl);
+}
+
+void log_once(void *name, int initial_level, int subsequent_level, int *state, const char *fmt, ...)
+{
+    /* the load keeps the common case of a set state free of writes */
+    int first = !__atomic_load_n(state, __ATOMIC_RELAXED) &&
+                !__atomic_exchange_n(state, 1, __ATOMIC_RELAXED);
+    int level = first ? initial_level : subsequent_level;
+    va_list vl;
+
+    if (!log_level_enabled(level))
+        return;
+    va_start(vl, fmt);
+    vlog(name, level, fmt, vl);
+    va_end(vl);
+}
+
+void log_kv_array(void *name, int level, const char *msg,
+                  const LogKV *kv, int nb_kv)
+{
+    if (!log_level_enabled(level))
+        return;
+
+    if (atomic_load_explicit(&bin_enabled, memory_order_relaxed)) {
+        /* binary records only know printf arguments, record the text */
+        static __thread AVBPrint text;
+        int i;
+
+        bprint_init(&text, 0, 65536);
+        bprint_append_data(&text, msg, strlen(msg));
+        for (i = 0; i < nb_kv; i++) {
+            bprintf(&text, " %s=", kv[i].key);
+            bprint_kv_value(&text, &kv[i], 0);
+        }
+        log(name, level, "%s\n", text.str);
+        bprint_finalize(&text, NULL);
+        return;
+    }
+
+    cur_kv    = kv;
+    cur_nb_kv = nb_kv;
+    log(name, level, "%s", msg);
+    cur_kv    = NULL;
+    cur_nb_kv = 0;
+}
+
+int log_ratelimit(LogRateLimit *rl, void *name, int level, double rate, int burst)
+{
+    struct timespec ts;
+    int64_t now, tat, interval;
+
+    if (rate <= 0)
+        return 1;
+    interval = 1000000000 / rate;
+    burst    = FFMAX(burst, 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+
+    /* generic cell rate algorithm: a token bucket kept in one timestamp */
+    tat = __atomic_load_n(&rl->tat, __ATOMIC_RELAXED);
+    do {
+        if (tat - now > (burst - 1) * interval) {
+            ThreadStats *st = thread_stats();
+            __atomic_fetch_add(&rl->suppressed, 1, __ATOMIC_RELAXED);
+            if (st)
+                STAT_ADD(st->s.ratelimited, 1);
+            /* the first drop hands the site to the flush thread */
+            if (!__atomic_load_n(&rl->registered, __ATOMIC_RELAXED) &&
+                !__atomic_exchange_n(&rl->registered, 1, __ATOMIC_RELAXED)) {
+                rl->name = name;
+                rl->level = level;
+                __atomic_store_n(&rl->reported, now, __ATOMIC_RELAXED);
+                rl->next = atomic_load(&ratelimit_sites);
+                while (!atomic_compare_exchange_weak(&ratelimit_sites, &rl->next, rl))
+                    ;
+                flush_thread_start(RATELIMIT_REPORT_MS);
+            }
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&rl->tat, &tat, FFMAX(tat, now) + interval,
+                                          1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (__atomic_load_n(&rl->suppressed, __ATOMIC_RELAXED))
+        ratelimit_report(rl, name, level, now);
+    return 1;
+}
+
+int log_every_t(int64_t *next, int ms)
+{
+    struct timespec ts;
+    int64_t now, t;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+
+    t = __atomic_load_n(next, __ATOMIC_RELAXED);
+    if (now < t)
+        return 0;
+    /* only the thread which moves the deadline logs */
+    return __atomic_compare_exchange_n(next, &t, now + ms * INT64_C(1000000),
+                                       0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+int log_sample(double p)
+{
+    static __thread uint64_t state;
+    uint64_t x;
+
+    if (p >= 1)
+        return 1;
+    if (p <= 0)
+        return 0;
+
+    /* xorshift64*, seeded per thread */
+    if (!(x = state)) {
+        uintptr_t self = (uintptr_t)&state;
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        x = hash_bytes(ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec, &self, sizeof(self)) | 1;
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    state = x;
+    return (x * UINT64_C(0x2545f4914f6cdd1d) >> 11) * 0x1.0p-53 < p;
+}
+
+void vlog(void *name, int level, const char *fmt, va_list vl)
+{
+    void (*callback)(void*, int, const char*, va_list) =
+        __atomic_load_n(&log_callback, __ATOMIC_ACQUIRE);
+    int lvl = level >= 0 ? level & 0xff : level;
+
+    if (lvl <= __atomic_load_n(&log_recorder_level, __ATOMIC_RELAXED)) {
+        va_list vl2;
+        va_copy(vl2, vl);
+        recorder_log(name, lvl, fmt, vl2);
+        va_end(vl2);
+        /* below the output level, the message was only logged for the
+           recorder */
+        if (lvl > __atomic_load_n(&output_threshold, __ATOMIC_RELAXED))
+            return;
+    }
+
+    if (callback)
+        callback(name, level, fmt, vl);
+}
+
+int log_get_level(void)
+{
+    return log_level;
+}
+
+void log_set_level(int level)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&tag_mutex);
     log_level = level;
+    __atomic_store_n(&default_tag.level, level, __ATOMIC_RELAXED);
+    for (i = 0; i < MAX_TAGS; i++) {
+        LogTag *tag = atomic_load_explicit(&tags[i], memory_order_relaxed);
+        if (tag && !tag->override)
+            __atomic_store_n(&tag->level, level, __ATOMIC_RELAXED);
+    }
+    update_threshold();
+    pthread_mutex_unlock(&tag_mutex);
+}
+
+void log_set_tag_level(const char *name, int level)
+{
+    LogTag *tag = log_tag_get(name);
+
+    if (tag == &default_tag)
+        return;
+
+    pthread_mutex_lock(&tag_mutex);
+    tag->override = level != LOG_TAG_INHERIT;
+    __atomic_store_n(&tag->level, tag->override ? level : log_level, __ATOMIC_RELAXED);
+    update_threshold();
+    pthread_mutex_unlock(&tag_mutex);
 }
 
 void log_set_flags(int arg)
@@ -1052,6 +4033,6 @@ int log_get_flags(void)
 
 void log_set_callback(void (*callback)(void*, int, const char*, va_list))
 {
-    log_callback = callback;
+    __atomic_store_n(&log_callback, callback, __ATOMIC_RELEASE);
 }
 
@@ -22,6 +22,8 @@
 #define __LOG_H__
 
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * @addtogroup lavu_log
@@ -108,8 +110,9 @@
  * function.
  * @see log_set_callback
  *
- * @param avcl A pointer to an arbitrary struct of which the first field is a
- *        pointer to an AVClass struct or NULL if general log.
+ * @param name The tag of the message, or NULL. Tags are cached by address,
+ *        so the string must not change while the process logs; string
+ *        literals are the usual choice, as for LOG_AT().
  * @param level The importance level of the message expressed using a @ref
  *        lavu_log_constants "Logging Constant".
  * @param fmt The format string (printf-compatible) that specifies how
@@ -133,8 +136,9 @@ void log(void *name, int level, const char *fmt, ...) printf_format(3, 4);
  * @param fmt The format string (printf-compatible) that specifies how
  *        subsequent arguments are converted to output.
  * @param state a variable to keep trak of if a message has already been printed
- *        this must be initialized to 0 before the first use. The same state
- *        must not be accessed by 2 Threads simultaneously.
+ *        this must be initialized to 0 before the first use. It is updated
+ *        atomically, exactly one caller gets the initial_level even if
+ *        several threads share the state.
  */
 void log_once(void *name, int initial_level, int subsequent_level, int *state, const char *fmt, ...) printf_format(5, 6);
 
@@ -173,6 +177,270 @@ int log_get_level(void);
  */
 void log_set_level(int level);
 
+/**
+ * Highest level at which a message can currently produce any output,
+ * taking per tag levels into account.
+ * Maintained by the library, applications must not write it.
+ */
+extern int log_threshold;
+
+/**
+ * Highest level recorded by the flight recorder, INT_MIN when it is off.
+ * Maintained by the library, applications must not write it.
+ */
+extern int log_recorder_level;
+
+/**
+ * Check whether a message of the given level would be output, without
+ * evaluating any of its arguments.
+ */
+static inline int log_level_enabled(int level)
+{
+    if (level >= 0)
+        level &= 0xff;
+    return __builtin_expect(level <= __atomic_load_n(&log_threshold, __ATOMIC_RELAXED), 0);
+}
+
+/**
+ * Messages above this level are removed at compile time by the LOG*()
+ * macros below, including the evaluation of their arguments.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_TRACE
+#endif
+
+/**
+ * Per tag log level, as returned by log_tag_get().
+ * Tags are interned and never freed, so the pointer can be cached.
+ */
+typedef struct LogTag {
+    const char *name;
+    int level;          ///< effective level, read with __atomic_load_n()
+    int override;       ///< private, set by log_set_tag_level()
+    int index;          ///< private, slot in the tag table
+} LogTag;
+
+/**
+ * Use the global log level for this tag, see log_set_tag_level().
+ */
+#define LOG_TAG_INHERIT -16
+
+/**
+ * Intern a tag.
+ *
+ * Lookups never lock, only the first use of a new tag does.
+ *
+ * @param name the tag, as passed to log(); NULL for messages without a tag
+ * @return the tag, never NULL
+ */
+LogTag *log_tag_get(const char *name);
+
+/**
+ * Set the log level of all messages logged with the given tag.
+ *
+ * @param name  the tag, as passed to log()
+ * @param level Logging level, or LOG_TAG_INHERIT to follow log_set_level()
+ *              again
+ */
+void log_set_tag_level(const char *name, int level);
+
+/**
+ * Check whether a message of the given level and tag would be output or
+ * kept by the flight recorder.
+ *
+ * @param site per call site cache of the tag, initially NULL; the tag must
+ *             be the same for every execution of the call site
+ */
+static inline int log_tag_enabled(LogTag **site, const char *name, int level)
+{
+    LogTag *tag = __atomic_load_n(site, __ATOMIC_ACQUIRE);
+
+    if (__builtin_expect(!tag, 0)) {
+        tag = log_tag_get(name);
+        __atomic_store_n(site, tag, __ATOMIC_RELEASE);
+    }
+    if (level >= 0)
+        level &= 0xff;
+    return __builtin_expect(level <= __atomic_load_n(&tag->level, __ATOMIC_RELAXED) ||
+                            level <= __atomic_load_n(&log_recorder_level, __ATOMIC_RELAXED), 0);
+}
+
+/**
+ * Log a message if level is enabled for the tag, the arguments are only
+ * evaluated if the message is going to be output. The tag is looked up once
+ * per call site, so name must not change between executions.
+ * @code
+   LOGD(TAG, "decoded frame %d\n", n);
+   @endcode
+ */
+#define LOG_AT(name, level, ...)                                           \
+    do {                                                                   \
+        static LogTag *log_site_tag;                                       \
+        if (((level) & 0xff) <= LOG_COMPILE_LEVEL &&                       \
+            log_tag_enabled(&log_site_tag, name, level))                   \
+            log(name, level, __VA_ARGS__);                                 \
+    } while (0)
+
+#if LOG_COMPILE_LEVEL >= LOG_PANIC
+#define LOGP(name, ...) LOG_AT(name, LOG_PANIC, __VA_ARGS__)
+#else
+#define LOGP(name, ...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_FATAL
+#define LOGF(name, ...) LOG_AT(name, LOG_FATAL, __VA_ARGS__)
+#else
+#define LOGF(name, ...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_ERROR
+#define LOGE(name, ...) LOG_AT(name, LOG_ERROR, __VA_ARGS__)
+#else
+#define LOGE(name, ...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_WARNING
+#define LOGW(name, ...) LOG_AT(name, LOG_WARNING, __VA_ARGS__)
+#else
+#define LOGW(name, ...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_INFO
+#define LOGI(name, ...) LOG_AT(name, LOG_INFO, __VA_ARGS__)
+#else
+#define LOGI(name, ...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_VERBOSE
+#define LOGV(name, ...) LOG_AT(name, LOG_VERBOSE, __VA_ARGS__)
+#else
+#define LOGV(name, ...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_DEBUG
+#define LOGD(name, ...) LOG_AT(name, LOG_DEBUG, __VA_ARGS__)
+#else
+#define LOGD(name, ...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_TRACE
+#define LOGT(name, ...) LOG_AT(name, LOG_TRACE, __VA_ARGS__)
+#else
+#define LOGT(name, ...) do { } while (0)
+#endif
+
+/**
+ * Per call site state of LOG_RATELIMIT(), must be zero initialized.
+ */
+typedef struct LogRateLimit {
+    int64_t tat;            ///< theoretical arrival time of the next message, in ns
+    unsigned suppressed;    ///< messages dropped since the last summary
+    int registered;         ///< private, the site is in the list of the flush thread
+    int64_t reported;       ///< private, time of the last summary, in ns
+    void *name;             ///< private, tag of the summaries
+    int level;              ///< private, level of the summaries
+    struct LogRateLimit *next;  ///< private, next site which dropped messages
+} LogRateLimit;
+
+/**
+ * Token bucket check for LOG_RATELIMIT().
+ *
+ * Lock-free, safe to call from any number of threads on the same state.
+ * A line telling how many messages were suppressed is logged with the
+ * same tag and level before the next message let through, and by the
+ * flush thread once a second while messages are dropped and none gets
+ * through, as well as at exit. The state must therefore stay valid as
+ * long as the process logs, as the static state of LOG_RATELIMIT() does.
+ *
+ * @param rate  sustained number of messages per second
+ * @param burst number of messages which may be logged back to back
+ * @return 1 if the message may be logged, 0 if it must be dropped
+ */
+int log_ratelimit(LogRateLimit *rl, void *name, int level, double rate, int burst);
+
+/**
+ * Log a message at most rate times per second on average, with bursts of
+ * up to burst messages. Excess messages are dropped before any formatting
+ * and periodically summarized.
+ * @code
+   LOG_RATELIMIT(TAG, LOG_WARNING, 10, 50, "invalid packet %d\n", n);
+   @endcode
+ */
+#define LOG_RATELIMIT(name, level, rate, burst, ...)                       \
+    do {                                                                   \
+        static LogTag *log_site_tag;                                       \
+        static LogRateLimit log_site_rl;                                   \
+        if (((level) & 0xff) <= LOG_COMPILE_LEVEL &&                       \
+            log_tag_enabled(&log_site_tag, name, level) &&                 \
+            log_ratelimit(&log_site_rl, name, level, rate, burst))         \
+            log(name, level, __VA_ARGS__);                                 \
+    } while (0)
+
+/**
+ * Sampling checks for LOG_EVERY_T() and LOG_SAMPLE(), safe to call from any
+ * number of threads.
+ *
+ * @param next per call site time before which nothing is logged, in ns,
+ *             must be zero initialized
+ * @return 1 if the message may be logged, 0 if it must be dropped
+ */
+int log_every_t(int64_t *next, int ms);
+
+/**
+ * @param p probability of logging a message, between 0 and 1
+ * @return 1 if the message may be logged, 0 if it must be dropped
+ */
+int log_sample(double p);
+
+/**
+ * Sampled logging of frequent messages.
+ *
+ * The decision is taken with per call site atomic counters or timestamps,
+ * after the level check and before any argument is evaluated, so dropped
+ * messages cost a few instructions. Only executions at which the level is
+ * enabled count.
+ *
+ * LOG_FIRST_N() logs the first n executions, LOG_EVERY_N() the 1st, the
+ * n+1th and so on, LOG_EVERY_T() at most one every ms milliseconds and
+ * LOG_SAMPLE() each one with probability p. A count n of 0 or less logs
+ * nothing; n may be evaluated more than once.
+ * @code
+   LOG_EVERY_N(TAG, LOG_DEBUG, 1000, "packet %d size %d\n", n, size);
+   @endcode
+ */
+#define LOG_FIRST_N(name, level, n, ...)                                   \
+    do {                                                                   \
+        static LogTag *log_site_tag;                                       \
+        static unsigned log_site_count;                                    \
+        if (((level) & 0xff) <= LOG_COMPILE_LEVEL &&                       \
+            (n) > 0 && log_tag_enabled(&log_site_tag, name, level) &&      \
+            __atomic_load_n(&log_site_count, __ATOMIC_RELAXED) < (n) &&    \
+            __atomic_fetch_add(&log_site_count, 1, __ATOMIC_RELAXED) < (n))\
+            log(name, level, __VA_ARGS__);                                 \
+    } while (0)
+
+#define LOG_EVERY_N(name, level, n, ...)                                   \
+    do {                                                                   \
+        static LogTag *log_site_tag;                                       \
+        static uint64_t log_site_count;                                    \
+        if (((level) & 0xff) <= LOG_COMPILE_LEVEL &&                       \
+            (n) > 0 && log_tag_enabled(&log_site_tag, name, level) &&      \
+            __atomic_fetch_add(&log_site_count, 1, __ATOMIC_RELAXED) % (n) == 0) \
+            log(name, level, __VA_ARGS__);                                 \
+    } while (0)
+
+#define LOG_EVERY_T(name, level, ms, ...)                                  \
+    do {                                                                   \
+        static LogTag *log_site_tag;                                       \
+        static int64_t log_site_next;                                      \
+        if (((level) & 0xff) <= LOG_COMPILE_LEVEL &&                       \
+            log_tag_enabled(&log_site_tag, name, level) &&                 \
+            log_every_t(&log_site_next, ms))                               \
+            log(name, level, __VA_ARGS__);                                 \
+    } while (0)
+
+#define LOG_SAMPLE(name, level, p, ...)                                    \
+    do {                                                                   \
+        static LogTag *log_site_tag;                                       \
+        if (((level) & 0xff) <= LOG_COMPILE_LEVEL &&                       \
+            log_tag_enabled(&log_site_tag, name, level) &&                 \
+            log_sample(p))                                                 \
+            log(name, level, __VA_ARGS__);                                 \
+    } while (0)
+
 /**
  * Set the logging callback
  *
@@ -230,8 +498,13 @@ int log_format_line2(void *name, int level, const char *fmt, va_list vl,
  * (f)printf as the 2 would otherwise interfere and lead to
  * "Last message repeated x times" messages below (f)printf messages with some
  * bad luck.
+ * Repeats are detected per thread among its last few lines, so lines of other
+ * threads in between do not break a repetition. Counts are reported before
+ * the next line of the same thread and at least once a second while the
+ * repetition goes on.
  * Also to receive the last, "last repeated" line if any, the user app must
- * call log(NULL, LOG_QUIET, "%s", ""); at the end
+ * call log(NULL, LOG_QUIET, "%s", ""); at the end, from every thread which
+ * logged.
  */
 #define LOG_SKIP_REPEATED 1
 
@@ -243,9 +516,456 @@ int log_format_line2(void *name, int level, const char *fmt, va_list vl,
  */
 #define LOG_PRINT_LEVEL 2
 
+/**
+ * Prefix every line with the time it was logged at, by default the local
+ * wall clock time with microseconds:
+ * 2026-10-18 12:34:56.123456 [info] message
+ * The date and time up to the second are formatted at most once per second
+ * and thread, only the fractional digits are formatted for every line.
+ */
+#define LOG_PRINT_TIME 4
+
+/**
+ * With LOG_PRINT_TIME, print the seconds of CLOCK_MONOTONIC instead of the
+ * wall clock time. Binary logs then record CLOCK_MONOTONIC times too.
+ */
+#define LOG_TIME_MONOTONIC 8
+
+/**
+ * With LOG_PRINT_TIME, print nanoseconds instead of microseconds.
+ */
+#define LOG_TIME_NS 16
+
+/**
+ * Write every message as one line of JSON, without colors:
+ * {"time":"...","level":"info","tag":"demux","msg":"text","stream":1}
+ * time is only present with LOG_PRINT_TIME, tag only for tagged messages,
+ * the key-value pairs of log_kv() follow msg. Partial lines become records
+ * of their own, and LOG_SKIP_REPEATED has no effect.
+ */
+#define LOG_PRINT_JSON 32
+
+/**
+ * Fill the lock_wait and write_time histograms of log_get_stats(), at the
+ * cost of two clock reads per line, three when the lock is contended.
+ */
+#define LOG_STATS_TIMING 64
+
 void log_set_flags(int arg);
 int log_get_flags(void);
 
+enum {
+    LOG_KV_TYPE_INT,
+    LOG_KV_TYPE_UINT,
+    LOG_KV_TYPE_DOUBLE,
+    LOG_KV_TYPE_BOOL,
+    LOG_KV_TYPE_STR,
+};
+
+/**
+ * One key-value pair of a structured message, see log_kv().
+ */
+typedef struct LogKV {
+    const char *key;
+    int type;                   ///< LOG_KV_TYPE_*
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const char *s;
+    } v;
+} LogKV;
+
+#define LOG_KV_INT(key, val)    ((LogKV){ (key), LOG_KV_TYPE_INT,    { .i = (val) } })
+#define LOG_KV_UINT(key, val)   ((LogKV){ (key), LOG_KV_TYPE_UINT,   { .u = (val) } })
+#define LOG_KV_DOUBLE(key, val) ((LogKV){ (key), LOG_KV_TYPE_DOUBLE, { .d = (val) } })
+#define LOG_KV_BOOL(key, val)   ((LogKV){ (key), LOG_KV_TYPE_BOOL,   { .i = !!(val) } })
+#define LOG_KV_STR(key, val)    ((LogKV){ (key), LOG_KV_TYPE_STR,    { .s = (val) } })
+
+/**
+ * Log a message with key-value pairs.
+ *
+ * With LOG_PRINT_JSON the pairs become members of the JSON object of the
+ * line, otherwise they are appended to the message as key=value, strings
+ * being quoted and escaped if they contain spaces, quotes or '='.
+ * msg is not a format string. Strings are only referenced, not copied.
+ *
+ * @param kv    array of nb_kv pairs
+ */
+void log_kv_array(void *name, int level, const char *msg,
+                  const LogKV *kv, int nb_kv);
+
+/**
+ * Log a message with the LOG_KV_* pairs given as further arguments, e.g.
+ * log_kv("demux", LOG_INFO, "new stream", LOG_KV_INT("index", i),
+ *        LOG_KV_STR("codec", name));
+ * At least one pair is required, arguments are not evaluated if level is
+ * disabled.
+ */
+#define log_kv(name, level, msg, ...)                                       \
+    do {                                                                    \
+        if (log_level_enabled(level))                                       \
+            log_kv_array(name, level, msg, (const LogKV[]){ __VA_ARGS__ }, \
+                         sizeof((const LogKV[]){ __VA_ARGS__ }) /          \
+                         sizeof(LogKV));                                    \
+    } while (0)
+
+/**
+ * Set the functions used to allocate memory, for the buffers of long
+ * messages and the internal structures, including those of the sinks.
+ * Only the buffers of the io_uring sink are mapped with mmap() instead, as
+ * they are registered with the kernel.
+ *
+ * realloc_cb(NULL, size) must allocate, free_cb(NULL) must do nothing.
+ * Buffers are reused per thread, so long messages do not allocate in the
+ * steady state. This must be called before anything is logged or any sink
+ * is opened, as memory allocated with the former functions is released
+ * with the new ones.
+ *
+ * @param realloc_cb realloc() replacement, NULL for realloc()
+ * @param free_cb    free() replacement, NULL for free()
+ */
+void log_set_allocator(void *(*realloc_cb)(void *ptr, size_t size),
+                       void (*free_cb)(void *ptr));
+
+/**
+ * Format a time the way LOG_PRINT_TIME prefixes lines, including the
+ * trailing space.
+ *
+ * @param time  ns since the epoch, or of CLOCK_MONOTONIC if flags contains
+ *              LOG_TIME_MONOTONIC
+ * @param flags log flags selecting the clock and precision
+ * @return the length of the formatted time, like snprintf()
+ */
+int log_format_time(char *buf, int size, int64_t time, int flags);
+
+/**
+ * Switch the default callback to asynchronous output.
+ *
+ * Messages are formatted by the calling thread and queued into a bounded
+ * lock-free ring, a background thread writes them out. If the ring is full
+ * the message is dropped and the number of dropped messages is reported
+ * once there is room again. Queued messages are drained on exit.
+ *
+ * The thread writes lines within about 10 ms, or at once for LOG_ERROR and
+ * more severe levels and when the ring is filling up; log_flush() waits
+ * for all queued lines.
+ *
+ * @param queue_capacity number of messages the ring can hold, rounded up to
+ *                       a power of two; 0 drains the ring, stops the writer
+ *                       thread and returns to synchronous output
+ * @return 0 on success, a negative error code otherwise
+ */
+int log_set_async(unsigned queue_capacity);
+
+/**
+ * Record messages in binary form instead of formatting them.
+ *
+ * Only references to the format string and tag, a timestamp and the raw
+ * arguments are written, which is much cheaper than formatting. The format
+ * strings must stay valid and unchanged for the lifetime of the program,
+ * string literals are fine. Use the logdecode tool to turn the file into
+ * the same text the default callback would have printed.
+ *
+ * @param filename file to write to, it is truncated; NULL to flush and
+ *                 close the current file and go back to text output
+ * @return 0 on success, a negative error code otherwise
+ */
+int log_set_binary(const char *filename);
+
+/**
+ * Start, reconfigure or stop the flight recorder.
+ *
+ * The recorder keeps the last messages up to level in memory, including
+ * those above the log level which are not output, at the cost of copying
+ * their arguments; they are not formatted. The ring can be written out
+ * with log_dump_recorder(), and is written to filename when the process
+ * gets SIGSEGV, SIGBUS, SIGILL, SIGFPE or SIGABRT, before the previous
+ * handler of the signal runs. Dumps are binary logs, see logdecode.
+ *
+ * As in binary mode, format strings must stay valid until the ring is
+ * dumped; string literals are fine. Messages with long arguments are
+ * truncated.
+ *
+ * @param level    highest level recorded
+ * @param size     memory used by the ring in bytes, 0 to stop the recorder
+ * @param filename file written on a crash, NULL for no signal handlers
+ * @return 0 on success, a negative error code otherwise
+ */
+int log_set_recorder(int level, size_t size, const char *filename);
+
+/**
+ * Write the messages held by the flight recorder to a binary log file.
+ *
+ * @param filename file to write, NULL for the one given to
+ *                 log_set_recorder()
+ * @return 0 on success, a negative error code otherwise
+ */
+int log_dump_recorder(const char *filename);
+
+#define LOG_STATS_HIST_SIZE 32
+
+/**
+ * Counters of the default callback, see log_get_stats().
+ *
+ * The histograms count durations in ns: entry 0 counts those of 0 ns,
+ * entry i those in [2^(i-1), 2^i), the last one also all longer ones.
+ * They are only filled while LOG_STATS_TIMING is set.
+ */
+typedef struct LogStats {
+    uint64_t messages[8];   ///< messages logged per level, indexed by level / 8
+    uint64_t bytes;         ///< bytes of lines written to outputs, without colors
+    uint64_t repeated;      ///< lines suppressed by LOG_SKIP_REPEATED
+    uint64_t dropped;       ///< messages dropped as the asynchronous queue was full
+    uint64_t ratelimited;   ///< messages dropped by LOG_RATELIMIT()
+    uint64_t truncated;     ///< lines cut because they were too long
+    uint64_t sink_dropped;  ///< lines a sink dropped as its consumer did not keep up
+    uint64_t lock_wait[LOG_STATS_HIST_SIZE];    ///< waits for the output lock
+    uint64_t write_time[LOG_STATS_HIST_SIZE];   ///< time to write a line to all outputs
+} LogStats;
+
+/**
+ * Get the counters of the default callback since the start of the process.
+ *
+ * Each thread counts on its own, without any shared write, and this sums
+ * the counters of all threads, including those which have exited. The
+ * result is not a snapshot, counters of different threads are read at
+ * slightly different times.
+ */
+void log_get_stats(LogStats *stats);
+
+/**
+ * Get the number of messages logged per tag, like log_get_stats().
+ *
+ * @param callback called once for each tag which has messages, and with
+ *                 tag NULL for messages without a tag
+ */
+void log_get_tag_stats(void (*callback)(void *opaque, const char *tag, uint64_t messages),
+                       void *opaque);
+
+/**
+ * An output of the default callback, see log_add_sink().
+ */
+typedef struct LogSink LogSink;
+
+/**
+ * Line formats of the outputs.
+ */
+enum {
+    LOG_FORMAT_DEFAULT,     ///< LOG_FORMAT_JSON if LOG_PRINT_JSON is set, LOG_FORMAT_TEXT otherwise
+    LOG_FORMAT_TEXT,        ///< prefixes and message, colored on stderr
+    LOG_FORMAT_JSON,        ///< one JSON object per line, see LOG_PRINT_JSON
+};
+
+/**
+ * msync() policies of the memory mapped file sink.
+ */
+enum {
+    LOG_MSYNC_NONE,     ///< never, the kernel writes the pages back at its own pace
+    LOG_MSYNC_ASYNC,    ///< start writeback when a chunk is full and on log_flush()
+    LOG_MSYNC_ERROR,    ///< like LOG_MSYNC_ASYNC, and wait for it after LOG_ERROR or worse
+    LOG_MSYNC_SYNC,     ///< wait for writeback after every line
+};
+
+/**
+ * Open a sink which appends to a memory mapped file.
+ *
+ * The file is grown and mapped chunk_size bytes at a time, so writing a
+ * line is a plain memory copy. Lines already written survive a crash of
+ * the process as they are in the page cache. The end of the file is zero
+ * padded up to the chunk boundary until the sink is closed.
+ *
+ * @param sink         receives the new sink
+ * @param chunk_size   size by which the file is grown, 0 for a default
+ * @param msync_policy one of LOG_MSYNC_*
+ * @return 0 on success, a negative error code otherwise
+ */
+int log_sink_open_mmap(LogSink **sink, const char *filename,
+                       size_t chunk_size, int msync_policy);
+
+/**
+ * Compress rotated files with gzip, if zlib was available at build time.
+ */
+#define LOG_FILE_COMPRESS 1
+
+/**
+ * Open a sink which appends to a file and rotates it.
+ *
+ * When the file reaches max_bytes or is older than max_age seconds, it is
+ * renamed to filename.1, filename.1 to filename.2 and so on, and a new file
+ * is started. Renaming, reopening and compressing are done by a background
+ * thread, the logging threads only swap file descriptors.
+ *
+ * @param sink      receives the new sink
+ * @param max_bytes rotate when the file reaches this size, 0 for no limit
+ * @param max_age   rotate non-empty files after this many seconds, 0 for no
+ *                  limit
+ * @param max_files number of rotated files to keep, 0 for a default of 10
+ * @param flags     a combination of LOG_FILE_* flags
+ * @return 0 on success, a negative error code otherwise
+ */
+int log_sink_open_file(LogSink **sink, const char *filename, int64_t max_bytes,
+                       int max_age, int max_files, int flags);
+
+/**
+ * Open a sink which appends to a file through io_uring.
+ *
+ * Lines are gathered in queue_depth buffers registered with the kernel.
+ * A full buffer is submitted as one write and the next one is filled
+ * while it completes, so that writing costs about one system call per
+ * buffer; completions are reaped by the thread writing lines. Without
+ * io_uring, the buffers are written with pwritev().
+ *
+ * By default a buffer is submitted when it is full, on LOG_ERROR or worse
+ * and by log_flush(); log_sink_set_flush_policy() changes this, max_bytes
+ * is then capped by buffer_size. Writes complete out of order, after a
+ * crash of the system the file may contain zeros where lines were lost.
+ *
+ * @param sink        receives the new sink
+ * @param queue_depth number of buffers, which is also the maximum number
+ *                    of writes in flight, 0 for a default of 8
+ * @param buffer_size size of each buffer, 0 for a default of 64 KiB
+ * @return 0 on success, a negative error code otherwise
+ */
+int log_sink_open_uring(LogSink **sink, const char *filename,
+                        int queue_depth, size_t buffer_size);
+
+/**
+ * Open a sink which writes lines into a POSIX shared memory ring, for
+ * another process to write them out, see the logtail tool.
+ *
+ * Logging then costs a copy into the ring and no file I/O, and lines
+ * already in the ring are not lost if the process crashes. When the ring
+ * is full, lines are dropped; logtail reports how many. The object is
+ * created if needed and is not removed on close. If it already holds a
+ * ring of the same size, the lines of the previous writer which were not
+ * read yet are kept. Only one sink may write to a ring at a time.
+ *
+ * @param sink receives the new sink
+ * @param name name of the object, see shm_open(), e.g. "/myapp-log"
+ * @param size size of the ring, rounded up to a power of two, 0 for a
+ *             default of 4 MiB
+ * @return 0 on success, AVERROR(EBUSY) if another process writes to the
+ *         ring, a negative error code otherwise
+ */
+int log_sink_open_shm(LogSink **sink, const char *name, size_t size);
+
+/**
+ * Open a sink which sends lines to a Unix domain datagram socket, one
+ * datagram per line, typically to a local log collector.
+ *
+ * Lines are batched and each batch is sent with one system call. By
+ * default a batch is sent when it reaches 64 KiB or 1024 lines, 1 s after
+ * its first line, on LOG_ERROR or worse and by log_flush();
+ * log_sink_set_flush_policy() changes this, max_bytes 0 sends every line
+ * at once.
+ *
+ * Logging never waits for the collector longer than max_wait, and
+ * log_flush() and the flush policy's time limit never wait. Lines which
+ * could not be sent stay batched, and new lines are dropped while the
+ * batch is full; see LogStats.sink_dropped. If the collector is not
+ * listening, at open or later, the sink tries again to connect when it
+ * next has lines to send, at most every 100 ms to 5 s.
+ *
+ * @param sink     receives the new sink
+ * @param path     address of the collector's socket
+ * @param max_wait ms to wait for the collector when its queue is full,
+ *                 0 to drop lines instead, -1 to wait as long as needed
+ * @return 0 on success, a negative error code otherwise
+ */
+int log_sink_open_unix(LogSink **sink, const char *path, int max_wait);
+
+/**
+ * Open a sink which passes every line to a function.
+ *
+ * @param callback called with each complete line, without colors and
+ *                 0-terminated; calls are serialized
+ * @return 0 on success, a negative error code otherwise
+ */
+int log_sink_open_callback(LogSink **sink,
+                           void (*callback)(void *opaque, int level,
+                                            const char *line, size_t len),
+                           void *opaque);
+
+/**
+ * How a sink groups its writes and makes them durable,
+ * see log_sink_set_flush_policy().
+ */
+typedef struct LogFlushPolicy {
+    size_t max_bytes;   ///< lines are buffered up to this many bytes, 0 to write every line at once
+    int max_delay;      ///< ms after which buffered lines are written, 0 for no limit
+    int flush_level;    ///< a line at this level or more severe is written at once,
+                        ///< with the lines buffered before it; LOG_ERROR is typical
+    int sync_interval;  ///< ms between two fdatasync() of the written data, 0 for never
+} LogFlushPolicy;
+
+/**
+ * Set the flush policy of a sink.
+ *
+ * By default every line is written with one system call and never synced.
+ * Buffering lines trades the latency at which they reach the file, and
+ * what is lost if the process crashes, for fewer system calls. Buffered
+ * lines are written by log_flush() and at exit; with a sync interval,
+ * log_flush() syncs as well. Time limits are enforced by a background
+ * thread started by the first policy which has one.
+ *
+ * @param sink   the sink, NULL for stderr
+ * @param policy the new policy, the current buffer is written out first
+ * @return 0 on success, AVERROR(ENOSYS) if the sink does not support it
+ *         (the memory mapped sink has its msync policy instead),
+ *         another negative error code otherwise
+ */
+int log_sink_set_flush_policy(LogSink *sink, const LogFlushPolicy *policy);
+
+/**
+ * Close a sink and set *sink to NULL.
+ * It is removed from the outputs first.
+ */
+void log_sink_close(LogSink **sink);
+
+/**
+ * Add an output to the default callback, or change the level and format
+ * of an existing one.
+ *
+ * Outputs only filter further: a message must be enabled by the log level
+ * and its tag level before any output sees it. Each format is produced
+ * once per message, whatever the number of outputs using it. Changing the
+ * outputs does not block logging threads. Lines a sink still buffers are
+ * flushed at normal exit, see log_flush().
+ *
+ * @param sink   the output, NULL for stderr; it stays owned by the caller
+ * @param level  highest level written to this output
+ * @param format one of LOG_FORMAT_*
+ * @return 0 on success, a negative error code otherwise
+ */
+int log_add_sink(LogSink *sink, int level, int format);
+
+/**
+ * Remove an output of the default callback. Queued messages are written
+ * first; once this returns the sink is not used anymore.
+ *
+ * @param sink the output, NULL for stderr
+ * @return 0 on success, a negative error code otherwise
+ */
+int log_remove_sink(LogSink *sink);
+
+/**
+ * Make sink the only output of the default callback, for all levels.
+ * Lines are written without colors.
+ *
+ * @param sink the new output, NULL for stderr only; it stays owned by the
+ *             caller
+ */
+void log_set_sink(LogSink *sink);
+
+/**
+ * Wait until every message logged before this call has been written.
+ * In asynchronous mode this waits for the writer thread, in binary mode
+ * the buffered records are written out, and so are the lines buffered by
+ * a flush policy.
+ */
+void log_flush(void);
+
 /**
  * @}
  */
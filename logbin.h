@@ -0,0 +1,174 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Binary log stream layout, shared by log.c and logdecode.
+ *
+ * A stream starts with LOGBIN_MAGIC, followed by records. Every record
+ * starts with a one byte type, all fields are in host byte order.
+ *
+ * LOGBIN_DEF defines a string which later records refer to by id:
+ *   id (u32), length (u32), the string bytes without terminating 0.
+ *
+ * LOGBIN_MSG is one message:
+ *   size of the rest of the record (u32), format id (u32),
+ *   tag id (u32, 0 for no tag), level (i32), flags (i32),
+ *   print_prefix (u8), time in ns since the epoch, or of CLOCK_MONOTONIC
+ *   if flags contains LOG_TIME_MONOTONIC (i64),
+ *   then the arguments in the order the format string consumes them:
+ *   integers, pointers and '*' widths as 8 bytes, floating point values as
+ *   double or long double, strings as a length (u32) followed by the bytes.
+ */
+
+#ifndef __LOGBIN_H__
+#define __LOGBIN_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#define LOGBIN_MAGIC "LOGBIN01"
+#define LOGBIN_MAGIC_SIZE 8
+
+enum {
+    LOGBIN_DEF = 1,
+    LOGBIN_MSG = 2,
+};
+
+#define LOGBIN_MSG_HEADER_SIZE (4 + 4 + 4 + 4 + 4 + 1 + 8)
+
+enum {
+    LOGBIN_ARG_NONE,        ///< %%, nothing is stored
+    LOGBIN_ARG_INT,
+    LOGBIN_ARG_UINT,
+    LOGBIN_ARG_PTR,
+    LOGBIN_ARG_DOUBLE,
+    LOGBIN_ARG_LDOUBLE,
+    LOGBIN_ARG_STR,
+    LOGBIN_ARG_UNSUPPORTED, ///< wide characters, %n, %m, positional arguments...
+};
+
+/**
+ * Length modifiers, as they select the C type of an argument.
+ */
+enum {
+    LOGBIN_SIZE_INT,
+    LOGBIN_SIZE_CHAR,       ///< hh
+    LOGBIN_SIZE_SHORT,      ///< h
+    LOGBIN_SIZE_LONG,       ///< l
+    LOGBIN_SIZE_LLONG,      ///< ll, q
+    LOGBIN_SIZE_INTMAX,     ///< j
+    LOGBIN_SIZE_SIZE,       ///< z
+    LOGBIN_SIZE_PTRDIFF,    ///< t
+    LOGBIN_SIZE_LDOUBLE,    ///< L
+};
+
+typedef struct LogBinSpec {
+    const char *start;      ///< the '%' of the conversion
+    const char *end;        ///< first character after the conversion
+    int star_width;         ///< width is taken from an int argument
+    int star_prec;          ///< precision is taken from an int argument
+    int prec;               ///< literal precision, -1 if none
+    int size;               ///< LOGBIN_SIZE_*
+    int type;               ///< LOGBIN_ARG_*
+} LogBinSpec;
+
+/**
+ * Find and parse the next conversion of a printf format string.
+ *
+ * @return 1 if a conversion was found, the literal text before it is then
+ *         [fmt, spec->start); 0 if there is no further conversion
+ */
+static inline int logbin_next_spec(const char *fmt, LogBinSpec *spec)
+{
+    const char *p = strchr(fmt, '%');
+
+    if (!p)
+        return 0;
+
+    spec->start      = p++;
+    spec->star_width = 0;
+    spec->star_prec  = 0;
+    spec->prec       = -1;
+    spec->size       = LOGBIN_SIZE_INT;
+
+    while (*p && strchr("#0- +'I", *p))
+        p++;
+    if (*p == '*') {
+        spec->star_width = 1;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->star_prec = 1;
+            p++;
+        } else {
+            spec->prec = 0;
+            while (*p >= '0' && *p <= '9')
+                spec->prec = spec->prec * 10 + *p++ - '0';
+        }
+    }
+
+    switch (*p) {
+    case 'h': p++; spec->size = *p == 'h' ? p++, LOGBIN_SIZE_CHAR : LOGBIN_SIZE_SHORT; break;
+    case 'l': p++; spec->size = *p == 'l' ? p++, LOGBIN_SIZE_LLONG : LOGBIN_SIZE_LONG;  break;
+    case 'q': p++; spec->size = LOGBIN_SIZE_LLONG;   break;
+    case 'j': p++; spec->size = LOGBIN_SIZE_INTMAX;  break;
+    case 'z': p++; spec->size = LOGBIN_SIZE_SIZE;    break;
+    case 't': p++; spec->size = LOGBIN_SIZE_PTRDIFF; break;
+    case 'L': p++; spec->size = LOGBIN_SIZE_LDOUBLE; break;
+    }
+
+    switch (*p) {
+    case 'd': case 'i':
+        spec->type = LOGBIN_ARG_INT;
+        break;
+    case 'c':
+        spec->type = spec->size == LOGBIN_SIZE_INT ? LOGBIN_ARG_INT : LOGBIN_ARG_UNSUPPORTED;
+        break;
+    case 'u': case 'o': case 'x': case 'X':
+        spec->type = LOGBIN_ARG_UINT;
+        break;
+    case 'e': case 'E': case 'f': case 'F':
+    case 'g': case 'G': case 'a': case 'A':
+        spec->type = spec->size == LOGBIN_SIZE_LDOUBLE ? LOGBIN_ARG_LDOUBLE : LOGBIN_ARG_DOUBLE;
+        break;
+    case 's':
+        spec->type = spec->size == LOGBIN_SIZE_INT ? LOGBIN_ARG_STR : LOGBIN_ARG_UNSUPPORTED;
+        break;
+    case 'p':
+        spec->type = LOGBIN_ARG_PTR;
+        break;
+    case '%':
+        spec->type = spec->star_width || spec->star_prec ? LOGBIN_ARG_UNSUPPORTED : LOGBIN_ARG_NONE;
+        break;
+    default:
+        spec->type = LOGBIN_ARG_UNSUPPORTED;
+        break;
+    }
+    if (*p)
+        p++;
+    spec->end = p;
+    return 1;
+}
+
+#endif /* __LOGBIN_H__ */
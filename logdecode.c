@@ -0,0 +1,297 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Convert a binary log written in log_set_binary() mode, or a dump of the
+ * flight recorder, back to text.
+ *
+ * usage: logdecode [file]
+ * The text is written to stdout, the input is read from stdin if no file
+ * is given.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "logbin.h"
+
+#define BODY_SZ 65536
+
+static char **strings;
+static uint32_t nb_strings;
+
+static int read_full(FILE *f, void *buf, size_t size)
+{
+    return fread(buf, 1, size, f) == size;
+}
+
+static int define_string(uint32_t id, char *str)
+{
+    if (id >= nb_strings) {
+        uint32_t nb = id + 1 > 2 * nb_strings ? id + 1 : 2 * nb_strings;
+        char **tmp = calloc(nb, sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        if (strings)
+            memcpy(tmp, strings, nb_strings * sizeof(*tmp));
+        free(strings);
+        strings    = tmp;
+        nb_strings = nb;
+    }
+    free(strings[id]);
+    strings[id] = str;
+    return 0;
+}
+
+static const char *get_string(uint32_t id)
+{
+    return id < nb_strings ? strings[id] : NULL;
+}
+
+typedef struct Reader {
+    const uint8_t *p, *end;
+} Reader;
+
+#define READ(type, dst) do {                    \
+        if (r->end - r->p < sizeof(type))       \
+            return -1;                          \
+        memcpy(&(dst), r->p, sizeof(type));     \
+        r->p += sizeof(type);                   \
+    } while (0)
+
+#define PRINT_ARG(val)                                                         \
+    (spec.star_width && spec.star_prec ? snprintf(dst, room, sfmt, w, p, val) : \
+     spec.star_width                   ? snprintf(dst, room, sfmt, w, val)    : \
+     spec.star_prec                    ? snprintf(dst, room, sfmt, p, val)    : \
+                                         snprintf(dst, room, sfmt, val))
+
+/**
+ * Format the arguments recorded by bin_encode_args() with fmt.
+ */
+static int render(char *body, size_t size, const char *fmt, Reader *r)
+{
+    LogBinSpec spec;
+    size_t len = 0;
+
+    body[0] = 0;
+    while (logbin_next_spec(fmt, &spec)) {
+        char sfmt[64], str[4096];
+        char *dst = body + len;
+        size_t room = size - len;
+        int64_t i = 0, w = 0, p = 0;
+        uint64_t u;
+        double d;
+        long double ld;
+        uint32_t slen;
+        int ret;
+
+        len += snprintf(dst, room, "%.*s", (int)(spec.start - fmt), fmt);
+        len  = len < size ? len : size - 1;
+        dst  = body + len;
+        room = size - len;
+        fmt  = spec.end;
+
+        if (spec.end - spec.start >= sizeof(sfmt))
+            return -1;
+        memcpy(sfmt, spec.start, spec.end - spec.start);
+        sfmt[spec.end - spec.start] = 0;
+
+        if (spec.star_width)
+            READ(int64_t, w);
+        if (spec.star_prec)
+            READ(int64_t, p);
+        w = (int)w;
+        p = (int)p;
+
+        switch (spec.type) {
+        case LOGBIN_ARG_NONE:
+            ret = snprintf(dst, room, "%%");
+            break;
+        case LOGBIN_ARG_INT:
+            READ(int64_t, i);
+            switch (spec.size) {
+            case LOGBIN_SIZE_LONG:    ret = PRINT_ARG((long)i);      break;
+            case LOGBIN_SIZE_LLONG:   ret = PRINT_ARG((long long)i); break;
+            case LOGBIN_SIZE_INTMAX:  ret = PRINT_ARG((intmax_t)i);  break;
+            case LOGBIN_SIZE_SIZE:    ret = PRINT_ARG((ssize_t)i);   break;
+            case LOGBIN_SIZE_PTRDIFF: ret = PRINT_ARG((ptrdiff_t)i); break;
+            default:                  ret = PRINT_ARG((int)i);       break;
+            }
+            break;
+        case LOGBIN_ARG_UINT:
+            READ(uint64_t, u);
+            switch (spec.size) {
+            case LOGBIN_SIZE_LONG:    ret = PRINT_ARG((unsigned long)u);      break;
+            case LOGBIN_SIZE_LLONG:   ret = PRINT_ARG((unsigned long long)u); break;
+            case LOGBIN_SIZE_INTMAX:  ret = PRINT_ARG((uintmax_t)u);          break;
+            case LOGBIN_SIZE_SIZE:    ret = PRINT_ARG((size_t)u);             break;
+            case LOGBIN_SIZE_PTRDIFF: ret = PRINT_ARG((ptrdiff_t)u);          break;
+            default:                  ret = PRINT_ARG((unsigned)u);           break;
+            }
+            break;
+        case LOGBIN_ARG_PTR:
+            READ(uint64_t, u);
+            ret = PRINT_ARG((void *)(uintptr_t)u);
+            break;
+        case LOGBIN_ARG_DOUBLE:
+            READ(double, d);
+            ret = PRINT_ARG(d);
+            break;
+        case LOGBIN_ARG_LDOUBLE:
+            READ(long double, ld);
+            ret = PRINT_ARG(ld);
+            break;
+        case LOGBIN_ARG_STR:
+            READ(uint32_t, slen);
+            if (slen >= sizeof(str) || r->end - r->p < slen)
+                return -1;
+            memcpy(str, r->p, slen);
+            str[slen] = 0;
+            r->p += slen;
+            ret = PRINT_ARG(str);
+            break;
+        default:
+            return -1;
+        }
+        if (ret > 0)
+            len = len + ret < size ? len + ret : size - 1;
+    }
+    snprintf(body + len, size - len, "%s", fmt);
+    return 0;
+}
+
+static int format_line(char *line, int line_size, const char *tag, int level,
+                       int print_prefix, const char *fmt, ...)
+{
+    va_list vl;
+    int ret;
+
+    va_start(vl, fmt);
+    ret = log_format_line2((void *)tag, level, fmt, vl, line, line_size, &print_prefix);
+    va_end(vl);
+    return ret;
+}
+
+static int decode_msg(const uint8_t *rec, uint32_t size)
+{
+    static char body[BODY_SZ], line[BODY_SZ + 1024];
+    char stamp[64] = "";
+    int64_t time;
+    Reader reader = { rec + LOGBIN_MSG_HEADER_SIZE - 4, rec + size }, *r = &reader;
+    uint32_t fmt_id, tag_id;
+    int32_t level, flags;
+    const char *fmt, *tag = NULL;
+
+    if (size < LOGBIN_MSG_HEADER_SIZE - 4)
+        return -1;
+    memcpy(&fmt_id, rec,      4);
+    memcpy(&tag_id, rec +  4, 4);
+    memcpy(&level,  rec +  8, 4);
+    memcpy(&flags,  rec + 12, 4);
+    memcpy(&time,   rec + 17, 8);
+
+    if (!(fmt = get_string(fmt_id)) || (tag_id && !(tag = get_string(tag_id))))
+        return -1;
+    if (render(body, sizeof(body), fmt, r) < 0)
+        return -1;
+
+    /* the time is the one recorded, not the time of decoding; JSON lines
+       are printed without it */
+    if (rec[16] && (flags & LOG_PRINT_TIME) && !(flags & LOG_PRINT_JSON))
+        log_format_time(stamp, sizeof(stamp), time, flags);
+    log_set_flags(flags & ~LOG_PRINT_TIME);
+    format_line(line, sizeof(line), tag, level, rec[16], "%s", body);
+    fputs(stamp, stdout);
+    fputs(line, stdout);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *f = stdin;
+    char magic[LOGBIN_MAGIC_SIZE];
+    uint8_t *rec = NULL;
+    uint32_t rec_size = 0;
+    int type;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [file]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2 && !(f = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (!read_full(f, magic, sizeof(magic)) || memcmp(magic, LOGBIN_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "not a binary log\n");
+        return 1;
+    }
+
+    while ((type = getc(f)) != EOF) {
+        uint32_t id, size;
+
+        if (!read_full(f, type == LOGBIN_DEF ? &id : &size, 4))
+            goto truncated;
+        if (type == LOGBIN_DEF && !read_full(f, &size, 4))
+            goto truncated;
+        if (type != LOGBIN_DEF && type != LOGBIN_MSG) {
+            fprintf(stderr, "invalid record type %d\n", type);
+            return 1;
+        }
+
+        /* no valid record is that large, and size + 1 must not overflow */
+        if (size > BODY_SZ) {
+            fprintf(stderr, "invalid record size %u\n", size);
+            return 1;
+        }
+        if (size + 1 > rec_size) {
+            free(rec);
+            rec_size = size + 1;
+            if (!(rec = malloc(rec_size))) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+        if (!read_full(f, rec, size))
+            goto truncated;
+
+        if (type == LOGBIN_DEF) {
+            char *str = malloc(size + 1);
+            if (!str || define_string(id, str) < 0) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+            memcpy(str, rec, size);
+            str[size] = 0;
+        } else if (decode_msg(rec, size) < 0) {
+            fprintf(stderr, "invalid message record\n");
+        }
+    }
+    return 0;
+
+truncated:
+    fprintf(stderr, "truncated binary log\n");
+    return 1;
+}
@@ -0,0 +1,92 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Minimal stand-in for a log collector, to try out the Unix datagram
+ * socket sink, see log_sink_open_unix().
+ *
+ * usage: logrecv [-d us] path
+ *   -d us  sleep this long after each datagram, to act as a slow collector
+ *
+ * Binds a datagram socket to path, replacing any existing socket file,
+ * and writes every datagram received to stdout until SIGINT or SIGTERM.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa = { .sa_handler = on_signal };
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    static char buf[1 << 20];
+    int delay = 0, opt, fd;
+    ssize_t n;
+
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        switch (opt) {
+        case 'd': delay = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-d us] path\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || strlen(argv[optind]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "usage: %s [-d us] path\n", argv[0]);
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[optind]);
+
+    unlink(addr.sun_path);
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(addr.sun_path);
+        return 1;
+    }
+
+    /* no SA_RESTART, so that the signals interrupt recv() */
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!stop) {
+        if ((n = recv(fd, buf, sizeof(buf), 0)) < 0)
+            continue;
+        fwrite(buf, 1, n, stdout);
+        if (delay) {
+            fflush(stdout);
+            usleep(delay);
+        }
+    }
+    fflush(stdout);
+    close(fd);
+    unlink(addr.sun_path);
+    return 0;
+}
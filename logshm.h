@@ -0,0 +1,76 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Layout of the shared memory ring written by the shm sink and read by
+ * logtail.
+ *
+ * The object starts with a LogShmHeader, the ring follows at offset
+ * LOGSHM_HEADER_SIZE. head and tail count the bytes written and consumed
+ * since the ring was created, the position of a byte in the ring is its
+ * count modulo size. Each record is the line length (u32), the level
+ * (i32) and the line, padded to a multiple of 8 bytes; a record does not
+ * wrap, a length of LOGSHM_WRAP instead marks the rest of the ring as
+ * unused. There is one writer, the process owning the sink, and one
+ * reader.
+ */
+
+#ifndef __LOGSHM_H__
+#define __LOGSHM_H__
+
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOGSHM_MAGIC "LOGSHM01"
+#define LOGSHM_MAGIC_SIZE 8
+#define LOGSHM_HEADER_SIZE 256
+#define LOGSHM_REC_HEADER_SIZE 8
+#define LOGSHM_WRAP UINT32_MAX
+
+#define LOGSHM_REC_SIZE(len) (LOGSHM_REC_HEADER_SIZE + (((uint64_t)(len) + 7) & ~(uint64_t)7))
+
+typedef struct LogShmHeader {
+    char magic[LOGSHM_MAGIC_SIZE];  ///< written last when the ring is created
+    uint64_t size;          ///< ring size in bytes, a power of two
+    int32_t writer;         ///< pid of the writer, 0 once the sink is closed
+    uint32_t waiting;       ///< futex, set by the reader when it waits for lines
+    uint64_t dropped;       ///< lines dropped because the ring was full
+    uint64_t head __attribute__((aligned(64)));    ///< written by the writer
+    uint64_t tail __attribute__((aligned(64)));    ///< written by the reader
+} LogShmHeader;
+
+/**
+ * Wait until *addr is no longer val, at most timeout ms.
+ */
+static inline void logshm_futex_wait(uint32_t *addr, uint32_t val, int timeout)
+{
+    struct timespec ts = { timeout / 1000, timeout % 1000 * 1000000L };
+
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static inline void logshm_futex_wake(uint32_t *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+#endif /* __LOGSHM_H__ */
@@ -0,0 +1,152 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Interface between log.c and the output sinks, not part of the API.
+ */
+
+#ifndef __LOGSINK_H__
+#define __LOGSINK_H__
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "log.h"
+
+#ifndef AVERROR
+#define AVERROR(e) (-(e))
+#endif
+#ifndef FFMAX
+#define FFMAX(a,b) ((a) > (b) ? (a) : (b))
+#define FFMIN(a,b) ((a) > (b) ? (b) : (a))
+#endif
+
+/**
+ * Every sink context starts with this structure.
+ *
+ * The callbacks are only ever called by one thread at a time, with lock
+ * held. Each sink has its own lock, so that sinks do not wait for each other.
+ */
+struct LogSink {
+    pthread_mutex_t lock;   ///< set up by log_sink_init(), held by log.c around the callbacks
+    /**
+     * Write one complete line, described by iovcnt entries of iov.
+     * The line is already formatted and sanitized, without colors.
+     * @return 0 on success, a negative error code otherwise
+     */
+    int  (*write)(LogSink *sink, int level, const struct iovec *iov, int iovcnt);
+    /**
+     * Called by log_flush(), may be NULL.
+     */
+    void (*flush)(LogSink *sink);
+    /**
+     * Change the buffering of the sink, see log_sink_set_flush_policy().
+     * May be NULL if the sink has no such policy.
+     */
+    int  (*set_flush_policy)(LogSink *sink, const LogFlushPolicy *policy);
+    /**
+     * Called periodically once a flush policy with a time limit has been
+     * set, to enforce it when no line is logged. May be NULL.
+     */
+    void (*tick)(LogSink *sink);
+    /**
+     * Release all resources of the sink, including the context itself.
+     */
+    void (*close)(LogSink *sink);
+};
+
+/**
+ * Initialize the common part of a sink, to be called by the open function
+ * of the sink once it cannot fail anymore.
+ */
+static inline void log_sink_init(LogSink *sink)
+{
+    pthread_mutex_init(&sink->lock, NULL);
+}
+
+/**
+ * Write all of iov to fd, retrying on short writes and EINTR.
+ * iov is modified.
+ * @return 0 on success, a negative error code otherwise
+ */
+int log_write_iov(int fd, struct iovec *iov, int iovcnt);
+
+/**
+ * Allocate through the functions set with log_set_allocator(), like the
+ * rest of the library. log_mem_realloc(NULL, size) allocates.
+ */
+void *log_mem_realloc(void *ptr, size_t size);
+void *log_mem_mallocz(size_t size);
+void  log_mem_free(void *ptr);
+
+/**
+ * Count lines the calling sink dropped, see LogStats.sink_dropped.
+ */
+void log_stats_sink_dropped(uint64_t lines);
+
+/**
+ * Output buffer of a file descriptor which implements a LogFlushPolicy,
+ * for sinks writing to a descriptor.
+ */
+typedef struct LogBuffer {
+    int fd;
+    LogFlushPolicy policy;
+    char *data;             ///< policy.max_bytes bytes
+    size_t len;
+    int64_t first;          ///< when the oldest buffered line was added, in ms
+    int64_t synced;         ///< time of the last fdatasync(), in ms
+    int dirty;              ///< written to fd since the last fdatasync()
+} LogBuffer;
+
+void log_buffer_init(LogBuffer *b, int fd);
+
+/**
+ * @return 0 on success, a negative error code otherwise
+ */
+int log_buffer_set_policy(LogBuffer *b, const LogFlushPolicy *policy);
+
+/**
+ * Buffer or write one line according to the policy.
+ * @return 0 on success, a negative error code if a write failed, in which
+ *         case this line or the lines buffered before it were lost
+ */
+int log_buffer_write(LogBuffer *b, int level, const struct iovec *iov, int iovcnt);
+
+/**
+ * Write out the buffered lines, and sync if the policy has a sync interval.
+ */
+void log_buffer_flush(LogBuffer *b);
+
+/**
+ * Flush, then continue with another descriptor. The caller closes the
+ * old one.
+ */
+void log_buffer_set_fd(LogBuffer *b, int fd);
+
+/**
+ * Enforce the time limits of the policy.
+ */
+void log_buffer_tick(LogBuffer *b);
+
+/**
+ * Flush and free the buffer, the descriptor is left open.
+ */
+void log_buffer_uninit(LogBuffer *b);
+
+#endif /* __LOGSINK_H__ */
@@ -0,0 +1,94 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Sink passing complete lines to a user function.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logsink.h"
+
+typedef struct CallbackSink {
+    LogSink sink;
+    void (*callback)(void *opaque, int level, const char *line, size_t len);
+    void *opaque;
+    char *buf;              ///< the line is gathered here, calls are serialized
+    size_t size;
+} CallbackSink;
+
+static int callback_write(LogSink *sink, int level, const struct iovec *iov, int iovcnt)
+{
+    CallbackSink *s = (CallbackSink *)sink;
+    size_t total = 0;
+    char *dst;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if (total + 1 > s->size) {
+        char *buf = log_mem_realloc(s->buf, total + 1);
+        if (!buf)
+            return AVERROR(ENOMEM);
+        s->buf  = buf;
+        s->size = total + 1;
+    }
+
+    dst = s->buf;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+    *dst = 0;
+    s->callback(s->opaque, level, s->buf, total);
+    return 0;
+}
+
+static void callback_close(LogSink *sink)
+{
+    CallbackSink *s = (CallbackSink *)sink;
+
+    log_mem_free(s->buf);
+    log_mem_free(s);
+}
+
+int log_sink_open_callback(LogSink **sink,
+                           void (*callback)(void *opaque, int level,
+                                            const char *line, size_t len),
+                           void *opaque)
+{
+    CallbackSink *s;
+
+    *sink = NULL;
+    if (!callback)
+        return AVERROR(EINVAL);
+    if (!(s = log_mem_mallocz(sizeof(*s))))
+        return AVERROR(ENOMEM);
+
+    s->sink.write  = callback_write;
+    s->sink.close  = callback_close;
+    s->callback    = callback;
+    s->opaque      = opaque;
+
+    log_sink_init(&s->sink);
+    *sink = &s->sink;
+    return 0;
+}
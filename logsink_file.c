@@ -0,0 +1,345 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * File sink with size and age based rotation.
+ *
+ * Rotation is done by a background thread: it renames the rotated files,
+ * opens the new file and hands its descriptor over to the writing side,
+ * which only has to swap descriptors. Rotated files are then optionally
+ * compressed by the same thread. Writes go through a LogBuffer, which
+ * implements the flush policy.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if CONFIG_ZLIB
+#include <zlib.h>
+#endif
+
+#include "logsink.h"
+
+typedef struct FileSink {
+    LogSink sink;
+    char *filename;
+    int64_t max_bytes;
+    int max_age;
+    int max_files;
+    int flags;
+
+    int fd;                 ///< only used by the writing side
+    LogBuffer buf;          ///< writes to fd
+    atomic_int next_fd;     ///< new file opened by the thread, -1 if none
+    atomic_llong bytes;     ///< bytes written to the current file
+    atomic_llong rotate_at; ///< size triggering the next rotation, raised after a failure
+    atomic_int rotating;    ///< a rotation was requested and is not done yet
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+} FileSink;
+
+static void rotated_name(char *buf, size_t size, const char *filename, int i, int gz)
+{
+    snprintf(buf, size, "%s.%d%s", filename, i, gz ? ".gz" : "");
+}
+
+#if CONFIG_ZLIB
+static void compress_file(const char *src)
+{
+    char dst[PATH_MAX], buf[65536];
+    gzFile gz;
+    ssize_t n;
+    int fd, ok = 1;
+
+    if (snprintf(dst, sizeof(dst), "%s.gz", src) >= sizeof(dst))
+        return;
+    if ((fd = open(src, O_RDONLY | O_CLOEXEC)) < 0)
+        return;
+    if (!(gz = gzopen(dst, "wb"))) {
+        close(fd);
+        return;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (gzwrite(gz, buf, n) != n) {
+            ok = 0;
+            break;
+        }
+    }
+    close(fd);
+    if (gzclose(gz) != Z_OK || n < 0)
+        ok = 0;
+    if (ok)
+        unlink(src);
+    else
+        unlink(dst);
+}
+#endif
+
+/**
+ * Shift the rotated files, move the current one to .1 and open a new one.
+ * @return the new descriptor, or -1
+ */
+static int rotate(FileSink *s)
+{
+    char from[PATH_MAX], to[PATH_MAX];
+    int i, gz;
+
+    for (gz = 0; gz < 2; gz++) {
+        rotated_name(to, sizeof(to), s->filename, s->max_files, gz);
+        unlink(to);
+    }
+    for (i = s->max_files - 1; i > 0; i--) {
+        for (gz = 0; gz < 2; gz++) {
+            rotated_name(from, sizeof(from), s->filename, i,     gz);
+            rotated_name(to,   sizeof(to),   s->filename, i + 1, gz);
+            rename(from, to);
+        }
+    }
+    rotated_name(to, sizeof(to), s->filename, 1, 0);
+    if (rename(s->filename, to) < 0)
+        return -1;
+    return open(s->filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
+static void *file_thread(void *arg)
+{
+    FileSink *s = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&s->lock);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += s->max_age;
+
+    while (!s->stop) {
+        int fd;
+
+        if (!atomic_load(&s->rotating)) {
+            if (!s->max_age) {
+                pthread_cond_wait(&s->cond, &s->lock);
+            } else if (pthread_cond_timedwait(&s->cond, &s->lock, &deadline) == ETIMEDOUT) {
+                /* empty files are not rotated, wait for another period */
+                if (atomic_load(&s->bytes))
+                    atomic_store(&s->rotating, 1);
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += s->max_age;
+            }
+            continue;
+        }
+
+        pthread_mutex_unlock(&s->lock);
+        fd = rotate(s);
+        pthread_mutex_lock(&s->lock);
+
+        if (fd < 0) {
+            /* keep writing to the current file; retrying on every line
+               would rename files in a loop, so wait for another max_bytes
+               or another max_age */
+            atomic_store(&s->rotate_at, atomic_load(&s->bytes) + s->max_bytes);
+            atomic_store(&s->rotating, 0);
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += s->max_age;
+            continue;
+        }
+
+        /* wait for the writing side to switch before touching the old file */
+        atomic_store(&s->next_fd, fd);
+        while (atomic_load(&s->next_fd) >= 0 && !s->stop)
+            pthread_cond_wait(&s->cond, &s->lock);
+        atomic_store(&s->rotating, 0);
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += s->max_age;
+
+#if CONFIG_ZLIB
+        if ((s->flags & LOG_FILE_COMPRESS) && atomic_load(&s->next_fd) < 0) {
+            char name[PATH_MAX];
+            rotated_name(name, sizeof(name), s->filename, 1, 0);
+            pthread_mutex_unlock(&s->lock);
+            compress_file(name);
+            pthread_mutex_lock(&s->lock);
+        }
+#endif
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/**
+ * Start using the file opened by the rotation thread, if any.
+ */
+static void switch_file(FileSink *s)
+{
+    int fd = atomic_load(&s->next_fd);
+
+    if (fd < 0)
+        return;
+
+    /* buffered lines belong to the old file */
+    log_buffer_set_fd(&s->buf, fd);
+    close(s->fd);
+    s->fd = fd;
+    atomic_store(&s->bytes, 0);
+    atomic_store(&s->rotate_at, s->max_bytes);
+
+    pthread_mutex_lock(&s->lock);
+    atomic_store(&s->next_fd, -1);
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int file_write(LogSink *sink, int level, const struct iovec *iov, int iovcnt)
+{
+    FileSink *s = (FileSink *)sink;
+    size_t total = 0;
+    int64_t bytes;
+    int i, ret;
+
+    switch_file(s);
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if ((ret = log_buffer_write(&s->buf, level, iov, iovcnt)) < 0) {
+        log_stats_sink_dropped(1);
+        return ret;
+    }
+
+    bytes = atomic_fetch_add(&s->bytes, total) + total;
+    if (s->max_bytes && bytes >= atomic_load(&s->rotate_at) &&
+        !atomic_exchange(&s->rotating, 1)) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return 0;
+}
+
+static void file_flush(LogSink *sink)
+{
+    FileSink *s = (FileSink *)sink;
+
+    log_buffer_flush(&s->buf);
+}
+
+static int file_set_flush_policy(LogSink *sink, const LogFlushPolicy *policy)
+{
+    FileSink *s = (FileSink *)sink;
+
+    return log_buffer_set_policy(&s->buf, policy);
+}
+
+static void file_tick(LogSink *sink)
+{
+    FileSink *s = (FileSink *)sink;
+
+    log_buffer_tick(&s->buf);
+}
+
+static void file_close(LogSink *sink)
+{
+    FileSink *s = (FileSink *)sink;
+    int fd;
+
+    log_buffer_uninit(&s->buf);
+
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+
+    if ((fd = atomic_load(&s->next_fd)) >= 0)
+        close(fd);
+    close(s->fd);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    log_mem_free(s->filename);
+    log_mem_free(s);
+}
+
+int log_sink_open_file(LogSink **sink, const char *filename, int64_t max_bytes,
+                       int max_age, int max_files, int flags)
+{
+    FileSink *s;
+    struct stat st;
+    pthread_condattr_t attr;
+    int ret;
+
+    *sink = NULL;
+    if (!(s = log_mem_mallocz(sizeof(*s))))
+        return AVERROR(ENOMEM);
+    if (!(s->filename = log_mem_realloc(NULL, strlen(filename) + 1))) {
+        log_mem_free(s);
+        return AVERROR(ENOMEM);
+    }
+    strcpy(s->filename, filename);
+
+    s->fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (s->fd < 0 || fstat(s->fd, &st) < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+
+    s->sink.write            = file_write;
+    s->sink.flush            = file_flush;
+    s->sink.set_flush_policy = file_set_flush_policy;
+    s->sink.tick             = file_tick;
+    s->sink.close            = file_close;
+    s->max_bytes  = max_bytes;
+    s->max_age    = max_age;
+    s->max_files  = max_files > 0 ? max_files : 10;
+    s->flags      = flags;
+    log_buffer_init(&s->buf, s->fd);
+    atomic_init(&s->next_fd, -1);
+    atomic_init(&s->bytes, st.st_size);
+    atomic_init(&s->rotate_at, max_bytes);
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if ((ret = pthread_create(&s->thread, NULL, file_thread, s))) {
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->lock);
+        ret = AVERROR(ret);
+        goto fail;
+    }
+
+    log_sink_init(&s->sink);
+    *sink = &s->sink;
+    return 0;
+
+fail:
+    if (s->fd >= 0)
+        close(s->fd);
+    log_mem_free(s->filename);
+    log_mem_free(s);
+    return ret;
+}
@@ -0,0 +1,214 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Memory mapped file sink.
+ *
+ * The file is extended and mapped one chunk at a time, lines are copied
+ * into the mapping, so writing a line costs no system call. The data lives
+ * in the page cache and survives a crash of the process. Until the sink is
+ * closed the end of the file is padded with zeros up to the chunk boundary.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logsink.h"
+
+typedef struct MmapSink {
+    LogSink sink;
+    int fd;
+    int msync_policy;
+    size_t chunk_size;
+    size_t page_size;
+    char *map;
+    off_t map_offset;   ///< file offset of map
+    size_t map_size;
+    off_t pos;          ///< file offset of the end of the data
+    off_t synced;       ///< data before this offset has been passed to msync()
+} MmapSink;
+
+static void mmap_sync(MmapSink *s, int flags)
+{
+    off_t start = FFMAX(s->synced, s->map_offset) & ~(off_t)(s->page_size - 1);
+
+    if (!s->map || s->pos <= start)
+        return;
+    msync(s->map + (start - s->map_offset), s->pos - start, flags);
+    s->synced = s->pos;
+}
+
+/**
+ * Map the next chunk, starting at the page containing pos.
+ */
+static int mmap_next_chunk(MmapSink *s, size_t min_size)
+{
+    off_t offset = s->pos & ~(off_t)(s->page_size - 1);
+    size_t size  = FFMAX(s->chunk_size, min_size + (s->pos - offset));
+    char *map;
+
+    size = (size + s->page_size - 1) & ~(s->page_size - 1);
+
+    if (s->map) {
+        if (s->msync_policy != LOG_MSYNC_NONE)
+            mmap_sync(s, MS_ASYNC);
+        munmap(s->map, s->map_size);
+        s->map = NULL;
+    }
+
+    if (ftruncate(s->fd, offset + size) < 0)
+        return AVERROR(errno);
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, offset);
+    if (map == MAP_FAILED)
+        return AVERROR(errno);
+
+    s->map        = map;
+    s->map_offset = offset;
+    s->map_size   = size;
+    return 0;
+}
+
+static int mmap_write(LogSink *sink, int level, const struct iovec *iov, int iovcnt)
+{
+    MmapSink *s = (MmapSink *)sink;
+    size_t total = 0;
+    char *dst;
+    int i, ret;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    if (!s->map || s->pos + total > s->map_offset + s->map_size) {
+        if ((ret = mmap_next_chunk(s, total)) < 0)
+            return ret;
+    }
+
+    dst = s->map + (s->pos - s->map_offset);
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+    s->pos += total;
+
+    if (s->msync_policy == LOG_MSYNC_SYNC ||
+        (s->msync_policy == LOG_MSYNC_ERROR && level <= LOG_ERROR))
+        mmap_sync(s, MS_SYNC);
+    return 0;
+}
+
+static void mmap_flush(LogSink *sink)
+{
+    MmapSink *s = (MmapSink *)sink;
+
+    if (s->msync_policy != LOG_MSYNC_NONE)
+        mmap_sync(s, MS_ASYNC);
+}
+
+static void mmap_close(LogSink *sink)
+{
+    MmapSink *s = (MmapSink *)sink;
+
+    if (s->map) {
+        if (s->msync_policy != LOG_MSYNC_NONE)
+            mmap_sync(s, MS_SYNC);
+        munmap(s->map, s->map_size);
+    }
+    /* drop the padding after the last line */
+    ftruncate(s->fd, s->pos);
+    close(s->fd);
+    log_mem_free(s);
+}
+
+/**
+ * Find the end of the data of a file left padded by a process which did
+ * not close the sink. Lines never contain a zero byte.
+ * @return the offset following the last non-zero byte, or a negative
+ *         error code
+ */
+static off_t data_end(int fd, off_t size)
+{
+    char buf[65536];
+
+    while (size > 0) {
+        size_t len  = FFMIN(size, sizeof(buf));
+        off_t start = size - len;
+        ssize_t ret = pread(fd, buf, len, start);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret != len)
+            return ret < 0 ? AVERROR(errno) : AVERROR(EIO);
+        while (len && !buf[len - 1])
+            len--;
+        if (len)
+            return start + len;
+        size = start;
+    }
+    return 0;
+}
+
+int log_sink_open_mmap(LogSink **sink, const char *filename,
+                       size_t chunk_size, int msync_policy)
+{
+    MmapSink *s;
+    struct stat st;
+    int ret;
+
+    *sink = NULL;
+    if (!(s = log_mem_mallocz(sizeof(*s))))
+        return AVERROR(ENOMEM);
+
+    s->fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (s->fd < 0 || fstat(s->fd, &st) < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    /* new lines go after the data, not after the padding of a crashed run */
+    if ((s->pos = data_end(s->fd, st.st_size)) < 0) {
+        ret = s->pos;
+        goto fail;
+    }
+    if (s->pos < st.st_size && ftruncate(s->fd, s->pos) < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+
+    s->sink.write   = mmap_write;
+    s->sink.flush   = mmap_flush;
+    s->sink.close   = mmap_close;
+    s->msync_policy = msync_policy;
+    s->page_size    = sysconf(_SC_PAGESIZE);
+    s->chunk_size   = chunk_size ? chunk_size : 4 << 20;
+    s->synced       = s->pos;
+
+    log_sink_init(&s->sink);
+    *sink = &s->sink;
+    return 0;
+
+fail:
+    if (s->fd >= 0)
+        close(s->fd);
+    log_mem_free(s);
+    return ret;
+}
@@ -0,0 +1,186 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Shared memory ring sink, drained by logtail in another process.
+ *
+ * Lines are copied into a POSIX shared memory object, see logshm.h, so the
+ * process never does file I/O to log and the lines already written survive
+ * its crash. The reader is only woken up with a system call when it sleeps
+ * for lack of lines. When the reader does not keep up, the ring fills up
+ * and further lines are dropped and counted rather than waited for.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logshm.h"
+#include "logsink.h"
+
+typedef struct ShmSink {
+    LogSink sink;
+    LogShmHeader *hdr;
+    uint8_t *ring;
+    uint64_t mask;
+    uint64_t head;          ///< local copy of hdr->head, only the sink writes it
+    size_t map_size;
+} ShmSink;
+
+static void shm_put(ShmSink *s, uint64_t pos, uint32_t len, int32_t level)
+{
+    uint8_t *rec = s->ring + (pos & s->mask);
+
+    memcpy(rec,     &len,   4);
+    memcpy(rec + 4, &level, 4);
+}
+
+static int shm_write(LogSink *sink, int level, const struct iovec *iov, int iovcnt)
+{
+    ShmSink *s = (ShmSink *)sink;
+    LogShmHeader *h = s->hdr;
+    uint64_t tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+    uint64_t end  = h->size - (s->head & s->mask);
+    uint64_t need, skip;
+    size_t total = 0;
+    uint8_t *dst;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    need = LOGSHM_REC_SIZE(total);
+    skip = need > end ? end : 0;
+
+    if (total >= LOGSHM_WRAP || skip + need > h->size - (s->head - tail)) {
+        __atomic_fetch_add(&h->dropped, 1, __ATOMIC_RELAXED);
+        log_stats_sink_dropped(1);
+        return AVERROR(EAGAIN);
+    }
+
+    if (skip) {
+        shm_put(s, s->head, LOGSHM_WRAP, 0);
+        s->head += skip;
+    }
+    shm_put(s, s->head, total, level);
+    dst = s->ring + (s->head & s->mask) + LOGSHM_REC_HEADER_SIZE;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+    s->head += need;
+
+    /* pairs with the reader setting waiting and then checking head */
+    __atomic_store_n(&h->head, s->head, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&h->waiting, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&h->waiting, 0, __ATOMIC_SEQ_CST))
+        logshm_futex_wake(&h->waiting);
+    return 0;
+}
+
+static void shm_close(LogSink *sink)
+{
+    ShmSink *s = (ShmSink *)sink;
+    LogShmHeader *h = s->hdr;
+
+    __atomic_store_n(&h->writer, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&h->waiting, 0, __ATOMIC_SEQ_CST))
+        logshm_futex_wake(&h->waiting);
+    munmap(s->hdr, s->map_size);
+    log_mem_free(s);
+}
+
+int log_sink_open_shm(LogSink **sink, const char *name, size_t size)
+{
+    ShmSink *s;
+    LogShmHeader *h;
+    struct stat st;
+    uint64_t ring = 4096;
+    void *map;
+    int fd, ret, reuse;
+    pid_t writer;
+
+    *sink = NULL;
+    size = size ? size : 4 << 20;
+    if (size > SIZE_MAX / 2 - LOGSHM_HEADER_SIZE)
+        return AVERROR(EINVAL);
+    while (ring < size)
+        ring <<= 1;
+
+    if (!(s = log_mem_mallocz(sizeof(*s))))
+        return AVERROR(ENOMEM);
+    s->map_size = LOGSHM_HEADER_SIZE + ring;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        goto fail;
+    if (st.st_size && st.st_size != s->map_size) {
+        /* logtail may have the old ring mapped, do not truncate it under it */
+        close(fd);
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0)
+            goto fail;
+    }
+    /* a ring of the same size may still hold lines logtail has not read */
+    reuse = st.st_size == s->map_size;
+    if (!reuse && ftruncate(fd, s->map_size) < 0)
+        goto fail;
+    map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto fail;
+    close(fd);
+
+    h = map;
+    if (!reuse || memcmp(h->magic, LOGSHM_MAGIC, LOGSHM_MAGIC_SIZE) || h->size != ring) {
+        memset(h, 0, LOGSHM_HEADER_SIZE);
+        h->size = ring;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(h->magic, LOGSHM_MAGIC, LOGSHM_MAGIC_SIZE);
+    } else if ((writer = __atomic_load_n(&h->writer, __ATOMIC_ACQUIRE)) &&
+               writer != getpid() && !kill(writer, 0)) {
+        munmap(map, s->map_size);
+        log_mem_free(s);
+        return AVERROR(EBUSY);
+    }
+
+    s->sink.write  = shm_write;
+    s->sink.close  = shm_close;
+    s->hdr         = h;
+    s->ring        = (uint8_t *)map + LOGSHM_HEADER_SIZE;
+    s->mask        = ring - 1;
+    s->head        = h->head;
+    __atomic_store_n(&h->writer, getpid(), __ATOMIC_SEQ_CST);
+
+    log_sink_init(&s->sink);
+    *sink = &s->sink;
+    return 0;
+
+fail:
+    ret = AVERROR(errno);
+    if (fd >= 0)
+        close(fd);
+    log_mem_free(s);
+    return ret;
+}
@@ -0,0 +1,318 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Unix domain datagram socket sink, for a local log collector.
+ *
+ * Every line is one datagram. Lines are batched and a batch is sent with
+ * a single sendmmsg(). The socket is non-blocking: when the collector is
+ * slow, a write waits at most max_wait ms for room, the lines which could
+ * not be sent stay batched and new lines are dropped once the batch is
+ * full. Flushes and ticks never wait, they run with the sink locked on
+ * behalf of log_flush() and the flush thread. When the collector goes
+ * away, the sink reconnects on later writes, at exponentially growing
+ * intervals; connecting a datagram socket does not block.
+ */
+
+/* sendmmsg() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logsink.h"
+
+#define MAX_BATCH   1024    ///< UIO_MAXIOV, sendmmsg() sends no more at once
+#define MAX_DELAY   1000    ///< default ms a batched line waits at most
+#define MIN_BACKOFF 100     ///< ms between connection attempts, doubled up to
+#define MAX_BACKOFF 5000    ///< this after each failure
+
+typedef struct UnixSink {
+    LogSink sink;
+    struct sockaddr_un addr;
+    int fd;                 ///< -1 while not connected
+    int max_wait;
+    int64_t retry;          ///< time of the next connection attempt, in ms
+    int backoff;            ///< ms until the attempt after that one
+
+    LogFlushPolicy policy;
+    char *data;             ///< batched lines back to back, policy.max_bytes bytes
+    size_t len;
+    int64_t first;          ///< when the oldest batched line was added, in ms
+    int nb_lines;
+    struct iovec lines[MAX_BATCH];      ///< iov_base is set when sending
+    struct mmsghdr msgs[MAX_BATCH];     ///< msgs[i] sends lines[i]
+} UnixSink;
+
+static int64_t unix_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000) + ts.tv_nsec / 1000000;
+}
+
+static int unix_connect(UnixSink *s, int64_t now)
+{
+    int fd, ret;
+
+    if (s->fd >= 0)
+        return 0;
+    if (now < s->retry)
+        return AVERROR(EAGAIN);
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&s->addr, sizeof(s->addr)) < 0) {
+        ret = AVERROR(errno);
+        if (fd >= 0)
+            close(fd);
+        s->retry   = now + s->backoff;
+        s->backoff = FFMIN(2 * s->backoff, MAX_BACKOFF);
+        return ret;
+    }
+    s->fd      = fd;
+    s->backoff = MIN_BACKOFF;
+    return 0;
+}
+
+/**
+ * Send nb datagrams, waiting at most wait ms for the collector, -1 for no
+ * limit.
+ * @return the number of datagrams done with, from the start of msgs
+ */
+static int unix_sendmmsg(UnixSink *s, struct mmsghdr *msgs, int nb, int64_t now, int wait)
+{
+    int64_t deadline = wait < 0 ? INT64_MAX : now + wait;
+    int done = 0, ret;
+
+    if (unix_connect(s, now) < 0)
+        return 0;
+
+    while (done < nb) {
+        ret = sendmmsg(s->fd, msgs + done, nb - done, MSG_NOSIGNAL);
+        if (ret > 0) {
+            done += ret;
+        } else if (!ret) {
+            /* nothing sent and errno is not set, try again later */
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EMSGSIZE) {
+            /* can never be sent, do not let it block the others */
+            log_stats_sink_dropped(1);
+            done++;
+        } else if (errno == EAGAIN) {
+            struct pollfd pfd = { s->fd, POLLOUT };
+            int64_t left = deadline - unix_clock();
+
+            if (left <= 0)
+                break;
+            if (poll(&pfd, 1, FFMIN(left, INT_MAX)) < 0 && errno != EINTR)
+                break;
+        } else {
+            /* the collector went away, try again on the next send */
+            close(s->fd);
+            s->fd    = -1;
+            s->retry = now;
+            break;
+        }
+    }
+    return done;
+}
+
+/**
+ * Send the batched lines; those which cannot be sent stay batched.
+ * @param wait see unix_sendmmsg()
+ */
+static void unix_send(UnixSink *s, int64_t now, int wait)
+{
+    char *p = s->data;
+    size_t sent_bytes = 0;
+    int i, sent;
+
+    if (!s->nb_lines)
+        return;
+    for (i = 0; i < s->nb_lines; i++) {
+        s->lines[i].iov_base = p;
+        p += s->lines[i].iov_len;
+    }
+
+    sent = unix_sendmmsg(s, s->msgs, s->nb_lines, now, wait);
+    if (!sent)
+        return;
+    for (i = 0; i < sent; i++)
+        sent_bytes += s->lines[i].iov_len;
+    memmove(s->data, s->data + sent_bytes, s->len - sent_bytes);
+    memmove(s->lines, s->lines + sent, (s->nb_lines - sent) * sizeof(*s->lines));
+    s->len      -= sent_bytes;
+    s->nb_lines -= sent;
+}
+
+static int unix_write(LogSink *sink, int level, const struct iovec *iov, int iovcnt)
+{
+    UnixSink *s = (UnixSink *)sink;
+    int64_t now = unix_clock();
+    size_t total = 0;
+    char *dst;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if (s->len + total > s->policy.max_bytes || s->nb_lines == MAX_BATCH)
+        unix_send(s, now, s->max_wait);
+
+    if (total > s->policy.max_bytes) {
+        /* not batched, sent from iov unless older lines are still waiting */
+        struct mmsghdr msg = { .msg_hdr = { .msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt } };
+
+        if (!s->nb_lines && unix_sendmmsg(s, &msg, 1, now, s->max_wait))
+            return 0;
+        log_stats_sink_dropped(1);
+        return AVERROR(EAGAIN);
+    }
+    if (s->len + total > s->policy.max_bytes || s->nb_lines == MAX_BATCH) {
+        log_stats_sink_dropped(1);
+        return AVERROR(EAGAIN);
+    }
+
+    dst = s->data + s->len;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+    if (!s->nb_lines)
+        s->first = now;
+    s->lines[s->nb_lines++].iov_len = total;
+    s->len += total;
+
+    if (level <= s->policy.flush_level ||
+        (s->policy.max_delay && now - s->first >= s->policy.max_delay))
+        unix_send(s, now, s->max_wait);
+    return 0;
+}
+
+static void unix_flush(LogSink *sink)
+{
+    UnixSink *s = (UnixSink *)sink;
+
+    unix_send(s, unix_clock(), 0);
+}
+
+static void unix_tick(LogSink *sink)
+{
+    UnixSink *s = (UnixSink *)sink;
+    int64_t now = unix_clock();
+
+    if (s->nb_lines && s->policy.max_delay && now - s->first >= s->policy.max_delay)
+        unix_send(s, now, 0);
+}
+
+static int unix_set_flush_policy(LogSink *sink, const LogFlushPolicy *policy)
+{
+    UnixSink *s = (UnixSink *)sink;
+    char *data;
+
+    if (policy->max_delay < 0 || policy->sync_interval < 0)
+        return AVERROR(EINVAL);
+    unix_send(s, unix_clock(), 0);
+    if (s->len > policy->max_bytes) {
+        log_stats_sink_dropped(s->nb_lines);
+        s->len      = 0;
+        s->nb_lines = 0;
+    }
+    if (!(data = log_mem_realloc(s->data, FFMAX(policy->max_bytes, 1))))
+        return AVERROR(ENOMEM);
+    s->data   = data;
+    s->policy = *policy;
+    return 0;
+}
+
+static void unix_close(LogSink *sink)
+{
+    UnixSink *s = (UnixSink *)sink;
+
+    /* the last chance for these lines, wait like a write */
+    unix_send(s, unix_clock(), s->max_wait);
+    log_stats_sink_dropped(s->nb_lines);
+    if (s->fd >= 0)
+        close(s->fd);
+    log_mem_free(s->data);
+    log_mem_free(s);
+}
+
+int log_sink_open_unix(LogSink **sink, const char *path, int max_wait)
+{
+    LogFlushPolicy policy;
+    UnixSink *s;
+    int i, ret;
+
+    *sink = NULL;
+    if (strlen(path) >= sizeof(s->addr.sun_path))
+        return AVERROR(ENAMETOOLONG);
+    if (!(s = log_mem_mallocz(sizeof(*s))))
+        return AVERROR(ENOMEM);
+
+    s->policy.max_bytes   = 65536;
+    s->policy.max_delay   = MAX_DELAY;
+    s->policy.flush_level = LOG_ERROR;
+    if (!(s->data = log_mem_realloc(NULL, s->policy.max_bytes))) {
+        log_mem_free(s);
+        return AVERROR(ENOMEM);
+    }
+    for (i = 0; i < MAX_BATCH; i++) {
+        s->msgs[i].msg_hdr.msg_iov    = &s->lines[i];
+        s->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    s->addr.sun_family = AF_UNIX;
+    strcpy(s->addr.sun_path, path);
+    s->fd       = -1;
+    s->max_wait = max_wait;
+    s->backoff  = MIN_BACKOFF;
+    /* the collector may not be up yet, writes connect later */
+    unix_connect(s, unix_clock());
+
+    s->sink.write            = unix_write;
+    s->sink.flush            = unix_flush;
+    s->sink.set_flush_policy = unix_set_flush_policy;
+    s->sink.tick             = unix_tick;
+    s->sink.close            = unix_close;
+
+    log_sink_init(&s->sink);
+
+    /* have the flush thread enforce max_delay, so that the lines of a
+       quiet service do not wait for a batch to fill */
+    policy = s->policy;
+    if ((ret = log_sink_set_flush_policy(&s->sink, &policy)) < 0) {
+        pthread_mutex_destroy(&s->sink.lock);
+        unix_close(&s->sink);
+        return ret;
+    }
+
+    *sink = &s->sink;
+    return 0;
+}
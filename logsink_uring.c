@@ -0,0 +1,520 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * File sink writing through io_uring.
+ *
+ * Lines are gathered in a set of buffers registered with the kernel. A
+ * buffer is submitted as one write at an explicit file offset, and the
+ * next one is filled while the kernel completes it; completions are reaped
+ * by the thread writing lines, without blocking as long as a buffer is
+ * free. The ring is driven with raw system calls, no library is needed.
+ * Without io_uring, at build or at run time, buffers are written with
+ * pwritev() instead.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#if CONFIG_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include "logsink.h"
+
+#define FSYNC_TAG UINT64_MAX
+
+typedef struct UringBuf {
+    char *data;
+    size_t len;
+    unsigned lines;         ///< number of lines in data, counted as dropped if lost
+    off_t off;              ///< file offset, once submitted
+    int busy;               ///< submitted and not completed yet
+} UringBuf;
+
+typedef struct UringSink {
+    LogSink sink;
+    int fd;
+    off_t pos;              ///< file offset of the next write
+    LogFlushPolicy policy;
+    size_t buffer_size;
+    int nb_bufs;
+    UringBuf *bufs;
+    char *mem;              ///< the data of all buffers
+    int cur;                ///< buffer being filled
+    int64_t first;          ///< when the first line of cur was added, in ms
+    int64_t synced;         ///< time of the last sync, in ms
+    int dirty;              ///< written since the last sync
+
+    int ring_fd;            ///< -1 when writing with pwritev()
+#if CONFIG_IO_URING
+    int fixed;              ///< buffers are registered
+    unsigned entries;
+    unsigned inflight;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+#endif
+} UringSink;
+
+static int64_t uring_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * INT64_C(1000) + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Write all of iov at off, retrying on short writes and EINTR.
+ * @return 0 on success, a negative error code otherwise
+ */
+static int pwrite_all(int fd, const struct iovec *iov, int iovcnt, off_t off)
+{
+    struct iovec tmp[16];
+
+    while (iovcnt > 0) {
+        int n = FFMIN(iovcnt, 16), i = 0;
+
+        memcpy(tmp, iov, n * sizeof(*tmp));
+        iov    += n;
+        iovcnt -= n;
+        while (i < n) {
+            ssize_t ret = pwritev(fd, tmp + i, n - i, off);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return ret < 0 ? AVERROR(errno) : AVERROR(EIO);
+            off += ret;
+            while (i < n && ret >= tmp[i].iov_len)
+                ret -= tmp[i++].iov_len;
+            if (i < n) {
+                tmp[i].iov_base = (char *)tmp[i].iov_base + ret;
+                tmp[i].iov_len -= ret;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write the part of a buffer from done on synchronously; its lines are
+ * counted as dropped if this fails.
+ */
+static int buf_write(UringSink *s, UringBuf *b, size_t done)
+{
+    struct iovec iov = { b->data + done, b->len - done };
+    int ret = pwrite_all(s->fd, &iov, 1, b->off + done);
+
+    if (ret < 0)
+        log_stats_sink_dropped(b->lines);
+    b->len   = 0;
+    b->lines = 0;
+    return ret;
+}
+
+#if CONFIG_IO_URING
+static int uring_enter(UringSink *s, unsigned to_submit, unsigned min_complete)
+{
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, s->ring_fd, to_submit, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+/**
+ * Process the available completions, after waiting for at least one if
+ * wait is set and something is in flight.
+ */
+static void uring_reap(UringSink *s, int wait)
+{
+    unsigned head;
+
+    if (wait && s->inflight)
+        uring_enter(s, 0, 1);
+
+    head = *s->cq_head;
+    while (head != __atomic_load_n(s->cq_tail, __ATOMIC_ACQUIRE)) {
+        const struct io_uring_cqe *cqe = &s->cqes[head & *s->cq_mask];
+
+        if (cqe->user_data != FSYNC_TAG) {
+            UringBuf *b = &s->bufs[cqe->user_data];
+            size_t done = cqe->res > 0 ? cqe->res : 0;
+            /* short or failed write, finish it synchronously */
+            if (done < b->len)
+                buf_write(s, b, done);
+            b->len   = 0;
+            b->lines = 0;
+            b->busy  = 0;
+        }
+        s->inflight--;
+        head++;
+    }
+    __atomic_store_n(s->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *uring_get_sqe(UringSink *s)
+{
+    unsigned tail = *s->sq_tail, idx;
+    struct io_uring_sqe *sqe;
+
+    while (s->inflight >= s->entries)
+        uring_reap(s, 1);
+
+    idx = tail & *s->sq_mask;
+    sqe = &s->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    s->sq_array[idx] = idx;
+    return sqe;
+}
+
+static void uring_submit_sqe(UringSink *s)
+{
+    __atomic_store_n(s->sq_tail, *s->sq_tail + 1, __ATOMIC_RELEASE);
+    s->inflight++;
+    uring_enter(s, 1, 0);
+}
+
+static void uring_unmap(UringSink *s)
+{
+    if (s->sqes)
+        munmap(s->sqes, s->entries * sizeof(*s->sqes));
+    if (s->cq_ptr && s->cq_ptr != s->sq_ptr)
+        munmap(s->cq_ptr, s->cq_size);
+    if (s->sq_ptr)
+        munmap(s->sq_ptr, s->sq_size);
+    close(s->ring_fd);
+    s->ring_fd = -1;
+}
+
+/**
+ * Set up the ring and register the buffers.
+ * @return 0 on success, a negative error code if io_uring is unusable
+ */
+static int uring_setup(UringSink *s)
+{
+    struct io_uring_params p = { 0 };
+    struct iovec *iov;
+    unsigned entries = 2 * s->nb_bufs;
+    int i;
+
+    s->ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (s->ring_fd < 0) {
+        s->ring_fd = -1;
+        return AVERROR(errno);
+    }
+    s->entries = p.sq_entries;
+
+    s->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    s->cq_size = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        s->sq_size = s->cq_size = FFMAX(s->sq_size, s->cq_size);
+
+    s->sq_ptr = mmap(NULL, s->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     s->ring_fd, IORING_OFF_SQ_RING);
+    if (s->sq_ptr == MAP_FAILED) {
+        s->sq_ptr = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        s->cq_ptr = s->sq_ptr;
+    } else {
+        s->cq_ptr = mmap(NULL, s->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         s->ring_fd, IORING_OFF_CQ_RING);
+        if (s->cq_ptr == MAP_FAILED) {
+            s->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+    s->sqes = mmap(NULL, p.sq_entries * sizeof(*s->sqes), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, s->ring_fd, IORING_OFF_SQES);
+    if (s->sqes == MAP_FAILED) {
+        s->sqes = NULL;
+        goto fail;
+    }
+
+    s->sq_head  = (unsigned *)((char *)s->sq_ptr + p.sq_off.head);
+    s->sq_tail  = (unsigned *)((char *)s->sq_ptr + p.sq_off.tail);
+    s->sq_mask  = (unsigned *)((char *)s->sq_ptr + p.sq_off.ring_mask);
+    s->sq_array = (unsigned *)((char *)s->sq_ptr + p.sq_off.array);
+    s->cq_head  = (unsigned *)((char *)s->cq_ptr + p.cq_off.head);
+    s->cq_tail  = (unsigned *)((char *)s->cq_ptr + p.cq_off.tail);
+    s->cq_mask  = (unsigned *)((char *)s->cq_ptr + p.cq_off.ring_mask);
+    s->cqes     = (struct io_uring_cqe *)((char *)s->cq_ptr + p.cq_off.cqes);
+
+    /* registration pins the pages, which RLIMIT_MEMLOCK may not allow;
+       plain writes of the same buffers still work */
+    if ((iov = log_mem_realloc(NULL, s->nb_bufs * sizeof(*iov)))) {
+        for (i = 0; i < s->nb_bufs; i++) {
+            iov[i].iov_base = s->bufs[i].data;
+            iov[i].iov_len  = s->buffer_size;
+        }
+        s->fixed = !syscall(__NR_io_uring_register, s->ring_fd,
+                            IORING_REGISTER_BUFFERS, iov, s->nb_bufs);
+        log_mem_free(iov);
+    }
+    return 0;
+
+fail:
+    uring_unmap(s);
+    return AVERROR(ENOMEM);
+}
+#endif
+
+/**
+ * Start writing the buffer being filled and make another one current.
+ * @return 0 on success, a negative error code if the buffer was written
+ *         synchronously and this failed
+ */
+static int submit_cur(UringSink *s)
+{
+    UringBuf *b = &s->bufs[s->cur];
+
+    if (!b->len)
+        return 0;
+    b->off   = s->pos;
+    s->pos  += b->len;
+    s->dirty = 1;
+
+#if CONFIG_IO_URING
+    if (s->ring_fd >= 0) {
+        struct io_uring_sqe *sqe = uring_get_sqe(s);
+        sqe->opcode    = s->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd        = s->fd;
+        sqe->addr      = (uintptr_t)b->data;
+        sqe->len       = b->len;
+        sqe->off       = b->off;
+        sqe->buf_index = s->cur;
+        sqe->user_data = s->cur;
+        b->busy = 1;
+        uring_submit_sqe(s);
+
+        s->cur = (s->cur + 1) % s->nb_bufs;
+        while (s->bufs[s->cur].busy)
+            uring_reap(s, 1);
+        return 0;
+    }
+#endif
+    return buf_write(s, b, 0);
+}
+
+static void uring_sync(UringSink *s, int64_t now)
+{
+    s->synced = now;
+    if (!s->dirty)
+        return;
+    s->dirty = 0;
+
+#if CONFIG_IO_URING
+    if (s->ring_fd >= 0) {
+        /* ordered after all the writes submitted before */
+        struct io_uring_sqe *sqe = uring_get_sqe(s);
+        sqe->opcode      = IORING_OP_FSYNC;
+        sqe->fd          = s->fd;
+        sqe->flags       = IOSQE_IO_DRAIN;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data   = FSYNC_TAG;
+        uring_submit_sqe(s);
+        return;
+    }
+#endif
+    fdatasync(s->fd);
+}
+
+static int uring_write(LogSink *sink, int level, const struct iovec *iov, int iovcnt)
+{
+    UringSink *s = (UringSink *)sink;
+    const LogFlushPolicy *p = &s->policy;
+    UringBuf *b = &s->bufs[s->cur];
+    int64_t now = 0;
+    size_t total = 0;
+    int i, ret = 0, err;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if (p->max_delay || p->sync_interval)
+        now = uring_clock();
+
+    if (b->len + total > s->buffer_size) {
+        ret = submit_cur(s);
+        b = &s->bufs[s->cur];
+    }
+    if (total > s->buffer_size) {
+        /* too long for any buffer, written directly at its own offset */
+        off_t off = s->pos;
+        s->pos  += total;
+        s->dirty = 1;
+        if ((err = pwrite_all(s->fd, iov, iovcnt, off)) < 0) {
+            log_stats_sink_dropped(1);
+            ret = err;
+        }
+    } else {
+        if (!b->len)
+            s->first = now;
+        for (i = 0; i < iovcnt; i++) {
+            memcpy(b->data + b->len, iov[i].iov_base, iov[i].iov_len);
+            b->len += iov[i].iov_len;
+        }
+        b->lines++;
+        if (b->len >= FFMAX(p->max_bytes, 1) || level <= p->flush_level ||
+            (p->max_delay && now - s->first >= p->max_delay)) {
+            if ((err = submit_cur(s)) < 0)
+                ret = err;
+        }
+    }
+
+#if CONFIG_IO_URING
+    if (s->ring_fd >= 0)
+        uring_reap(s, 0);
+#endif
+    if (p->sync_interval && now - s->synced >= p->sync_interval)
+        uring_sync(s, now);
+    return ret;
+}
+
+static void uring_flush(LogSink *sink)
+{
+    UringSink *s = (UringSink *)sink;
+
+    submit_cur(s);
+    if (s->policy.sync_interval)
+        uring_sync(s, uring_clock());
+#if CONFIG_IO_URING
+    while (s->ring_fd >= 0 && s->inflight)
+        uring_reap(s, 1);
+#endif
+}
+
+static void uring_tick(LogSink *sink)
+{
+    UringSink *s = (UringSink *)sink;
+    const LogFlushPolicy *p = &s->policy;
+    int64_t now = uring_clock();
+
+    if (s->bufs[s->cur].len && p->max_delay && now - s->first >= p->max_delay)
+        submit_cur(s);
+#if CONFIG_IO_URING
+    if (s->ring_fd >= 0)
+        uring_reap(s, 0);
+#endif
+    if (p->sync_interval && now - s->synced >= p->sync_interval)
+        uring_sync(s, now);
+}
+
+static int uring_set_flush_policy(LogSink *sink, const LogFlushPolicy *policy)
+{
+    UringSink *s = (UringSink *)sink;
+
+    if (policy->max_delay < 0 || policy->sync_interval < 0)
+        return AVERROR(EINVAL);
+    uring_flush(sink);
+    s->policy = *policy;
+    s->synced = uring_clock();
+    return 0;
+}
+
+static void uring_close(LogSink *sink)
+{
+    UringSink *s = (UringSink *)sink;
+
+    uring_flush(sink);
+#if CONFIG_IO_URING
+    if (s->ring_fd >= 0)
+        uring_unmap(s);
+#endif
+    close(s->fd);
+    munmap(s->mem, s->nb_bufs * s->buffer_size);
+    log_mem_free(s->bufs);
+    log_mem_free(s);
+}
+
+int log_sink_open_uring(LogSink **sink, const char *filename,
+                        int queue_depth, size_t buffer_size)
+{
+    UringSink *s;
+    struct stat st;
+    int i, ret;
+
+    *sink = NULL;
+    if (!(s = log_mem_mallocz(sizeof(*s))))
+        return AVERROR(ENOMEM);
+
+    s->ring_fd     = -1;
+    s->nb_bufs     = queue_depth > 0 ? queue_depth : 8;
+    s->buffer_size = buffer_size ? buffer_size : 65536;
+    s->bufs = log_mem_mallocz(s->nb_bufs * sizeof(*s->bufs));
+    /* the buffers stay registered with the kernel for the lifetime of the
+       sink, so they cannot come from the buffer pool, whose buffers belong
+       to one thread and are reallocated; they are mapped directly, which
+       also aligns them to pages */
+    s->mem = s->bufs ? mmap(NULL, s->nb_bufs * s->buffer_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+    if (s->mem == MAP_FAILED) {
+        log_mem_free(s->bufs);
+        log_mem_free(s);
+        return AVERROR(ENOMEM);
+    }
+    for (i = 0; i < s->nb_bufs; i++)
+        s->bufs[i].data = s->mem + i * s->buffer_size;
+
+    /* offsets are explicit, so no O_APPEND */
+    s->fd = open(filename, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (s->fd < 0 || fstat(s->fd, &st) < 0) {
+        ret = AVERROR(errno);
+        if (s->fd >= 0)
+            close(s->fd);
+        munmap(s->mem, s->nb_bufs * s->buffer_size);
+        log_mem_free(s->bufs);
+        log_mem_free(s);
+        return ret;
+    }
+    s->pos = st.st_size;
+
+#if CONFIG_IO_URING
+    /* without io_uring, at run time, fall back to pwritev() */
+    uring_setup(s);
+#endif
+
+    s->sink.write            = uring_write;
+    s->sink.flush            = uring_flush;
+    s->sink.set_flush_policy = uring_set_flush_policy;
+    s->sink.tick             = uring_tick;
+    s->sink.close            = uring_close;
+    s->policy.max_bytes      = s->buffer_size;
+    s->policy.flush_level    = LOG_ERROR;
+    s->synced                = uring_clock();
+
+    log_sink_init(&s->sink);
+    *sink = &s->sink;
+    return 0;
+}
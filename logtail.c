@@ -0,0 +1,288 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Write out the lines of a shared memory ring filled by the shm sink, see
+ * log_sink_open_shm().
+ *
+ * usage: logtail [-f] [-u] [-o file] name
+ *   -f       keep waiting for new lines, also across restarts of the
+ *            writer, until SIGINT or SIGTERM
+ *   -u       remove the shared memory object before exiting
+ *   -o file  append to file instead of stdout; the file is reopened on
+ *            SIGHUP, after it was rotated
+ *
+ * Without -f the lines currently in the ring are written and logtail
+ * exits. The number of lines the writer dropped because the ring was full
+ * is reported on stderr.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logshm.h"
+
+#define WAIT_MS 100
+
+typedef struct Ring {
+    LogShmHeader *hdr;
+    uint8_t *data;
+    size_t map_size;
+    ino_t ino;
+    uint64_t tail;          ///< consumed locally, published to hdr->tail per batch
+    uint64_t dropped;       ///< value of hdr->dropped last reported
+} Ring;
+
+static volatile sig_atomic_t stop, reopen;
+
+static void on_signal(int sig)
+{
+    if (sig == SIGHUP)
+        reopen = 1;
+    else
+        stop = 1;
+}
+
+/**
+ * @return 0 on success, 1 if there is no ring yet, -1 on error
+ */
+static int ring_open(Ring *r, const char *name)
+{
+    struct stat st;
+    void *map;
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+
+    if (fd < 0)
+        return errno == ENOENT ? 1 : -1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    /* the writer has not initialized it yet */
+    if (st.st_size <= LOGSHM_HEADER_SIZE) {
+        close(fd);
+        return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    r->hdr      = map;
+    r->data     = (uint8_t *)map + LOGSHM_HEADER_SIZE;
+    r->map_size = st.st_size;
+    r->ino      = st.st_ino;
+    if (memcmp(r->hdr->magic, LOGSHM_MAGIC, LOGSHM_MAGIC_SIZE)) {
+        munmap(map, r->map_size);
+        r->hdr = NULL;
+        return 1;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (r->hdr->size != r->map_size - LOGSHM_HEADER_SIZE) {
+        munmap(map, r->map_size);
+        r->hdr = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    r->tail    = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+    r->dropped = 0;
+    return 0;
+}
+
+static void ring_close(Ring *r)
+{
+    if (r->hdr)
+        munmap(r->hdr, r->map_size);
+    r->hdr = NULL;
+}
+
+/**
+ * @return 1 if name refers to another object than the mapped one, which
+ *         happens when a writer recreates the ring with another size
+ */
+static int ring_replaced(const Ring *r, const char *name)
+{
+    struct stat st;
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0), ret;
+
+    if (fd < 0)
+        return 0;
+    ret = !fstat(fd, &st) && st.st_ino != r->ino;
+    close(fd);
+    return ret;
+}
+
+static int writer_alive(const Ring *r)
+{
+    pid_t pid = __atomic_load_n(&r->hdr->writer, __ATOMIC_ACQUIRE);
+
+    return pid && (!kill(pid, 0) || errno != ESRCH);
+}
+
+/**
+ * Write the lines in the ring to out.
+ * @return the number of lines, -1 if the ring is corrupt
+ */
+static int drain(Ring *r, FILE *out)
+{
+    LogShmHeader *h = r->hdr;
+    uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+    uint64_t published = r->tail, dropped;
+    int lines = 0;
+
+    while (r->tail != head) {
+        const uint8_t *rec = r->data + (r->tail & (h->size - 1));
+        uint32_t len;
+
+        memcpy(&len, rec, 4);
+        if (len == LOGSHM_WRAP) {
+            r->tail += h->size - (r->tail & (h->size - 1));
+            continue;
+        }
+        if (LOGSHM_REC_SIZE(len) > head - r->tail)
+            return -1;
+        fwrite(rec + LOGSHM_REC_HEADER_SIZE, 1, len, out);
+        r->tail += LOGSHM_REC_SIZE(len);
+        lines++;
+
+        /* give space back to the writer before the whole ring is drained */
+        if (r->tail - published >= h->size / 4) {
+            __atomic_store_n(&h->tail, r->tail, __ATOMIC_RELEASE);
+            published = r->tail;
+        }
+        if (r->tail == head)
+            head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+    }
+    __atomic_store_n(&h->tail, r->tail, __ATOMIC_RELEASE);
+
+    dropped = __atomic_load_n(&h->dropped, __ATOMIC_RELAXED);
+    if (dropped != r->dropped) {
+        fprintf(stderr, "logtail: %"PRIu64" lines dropped\n", dropped - r->dropped);
+        r->dropped = dropped;
+    }
+    return lines;
+}
+
+/**
+ * Sleep until the writer adds a line, at most WAIT_MS.
+ */
+static void wait_lines(Ring *r)
+{
+    LogShmHeader *h = r->hdr;
+
+    /* pairs with the writer publishing head and then checking waiting */
+    __atomic_store_n(&h->waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&h->head, __ATOMIC_SEQ_CST) == r->tail && !stop)
+        logshm_futex_wait(&h->waiting, 1, WAIT_MS);
+    __atomic_store_n(&h->waiting, 0, __ATOMIC_RELAXED);
+}
+
+static FILE *open_output(const char *filename)
+{
+    FILE *f;
+
+    if (!filename)
+        return stdout;
+    if (!(f = fopen(filename, "ae")))
+        perror(filename);
+    return f;
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa = { .sa_handler = on_signal };
+    const char *name, *filename = NULL;
+    int follow = 0, unlink_ring = 0, opt, ret;
+    Ring r = { 0 };
+    FILE *out;
+
+    while ((opt = getopt(argc, argv, "fuo:")) != -1) {
+        switch (opt) {
+        case 'f': follow      = 1;      break;
+        case 'u': unlink_ring = 1;      break;
+        case 'o': filename    = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-f] [-u] [-o file] name\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-f] [-u] [-o file] name\n", argv[0]);
+        return 1;
+    }
+    name = argv[optind];
+    if (!(out = open_output(filename)))
+        return 1;
+
+    /* no SA_RESTART, so that the signals interrupt the wait */
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP,  &sa, NULL);
+
+    while (!stop) {
+        if (!r.hdr) {
+            if ((ret = ring_open(&r, name)) < 0) {
+                perror(name);
+                return 1;
+            }
+            if (ret) {
+                if (!follow)
+                    break;
+                usleep(WAIT_MS * 1000);
+                continue;
+            }
+        }
+
+        if (drain(&r, out) < 0) {
+            fprintf(stderr, "%s: corrupt ring\n", name);
+            return 1;
+        }
+        fflush(out);
+        if (reopen && filename) {
+            reopen = 0;
+            fclose(out);
+            if (!(out = open_output(filename)))
+                return 1;
+        }
+        if (!follow)
+            break;
+
+        if (!writer_alive(&r) && ring_replaced(&r, name))
+            ring_close(&r);
+        else
+            wait_lines(&r);
+    }
+
+    if (r.hdr && drain(&r, out) < 0)
+        fprintf(stderr, "%s: corrupt ring\n", name);
+    fflush(out);
+    ring_close(&r);
+    if (unlink_ring)
+        shm_unlink(name);
+    return 0;
+}